@@ -0,0 +1,430 @@
+// MIT License
+//
+// Copyright (c) 2022 Robert Blackwell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice (including the next
+// paragraph) shall be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF
+// OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef PIXELZ_BARNES_HUT_HPP
+#define PIXELZ_BARNES_HUT_HPP
+
+#include <pixelz/parallel.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PIXELZ_BARNES_HUT_SSE 1
+#endif
+
+namespace pixelz {
+
+// Mutual gravitation of n bodies in O(n log n) with a Barnes-Hut quadtree.
+//
+// Bodies are sorted by Morton code, so every quadtree cell is a contiguous
+// range of sorted bodies and the tree is built by splitting ranges. The top
+// levels are split on the calling thread until there are enough subtrees to
+// go around, then the subtrees are built in parallel, each into its own node
+// arena that is kept between steps, and spliced into the main node array.
+//
+// Forces are evaluated a group of nearby bodies at a time: a single walk of
+// the tree decides for the whole group which cells are far enough to treat as
+// a point mass (cell size < theta * distance), and the resulting interaction
+// list is then summed for each body four interactions at a time in SIMD lanes.
+// Each body is written by one thread in a fixed order, so the result does not
+// depend on the thread count.
+class BarnesHut {
+  public:
+    struct Options {
+        float theta = 0.5f;      // Opening angle, smaller is more accurate and slower
+        float softening = 1.0f;  // Added to distances so close encounters stay finite, must be positive
+        float constant = 1.0f;   // Gravitational constant
+        std::uint32_t leaf_size = 16;
+        std::uint32_t group_size = 64; // Bodies sharing one tree walk
+    };
+
+    struct Stats {
+        std::size_t nodes = 0;
+        std::size_t groups = 0;       // Tree walks
+        std::size_t subtrees = 0;     // Built in parallel
+        std::size_t interactions = 0; // Cells and bodies summed, over all bodies
+    };
+
+    void set_options(const Options &options) { options_ = options; }
+    const Options &options() const { return options_; }
+    const Stats &stats() const { return stats_; }
+
+    // Accelerations (ax, ay) of `count` bodies at (x, y) with masses `mass`
+    void step(const float *x, const float *y, const float *mass, std::size_t count, float *ax, float *ay,
+              WorkerPool &workers) {
+        stats_ = {};
+        if (count == 0)
+            return;
+        sort(x, y, mass, count, workers);
+        build(workers);
+        accelerate(ax, ay, workers);
+    }
+
+  private:
+    static constexpr int LEVELS = 16; // Morton bits per axis
+
+    // A quadtree cell, holding sorted bodies [begin, end). Non-empty
+    // children are stored next to each other from first_child.
+    struct Node {
+        float cx, cy, mass; // Centre of mass and total mass
+        float size;         // Side of the cell
+        std::uint32_t begin, end;
+        std::uint32_t first_child; // 0 for a leaf
+        std::uint32_t child_count;
+        std::uint32_t level;
+    };
+
+    Options options_;
+    Stats stats_;
+
+    // Bodies in Morton order
+    float min_x_ = 0.0f, min_y_ = 0.0f, side_ = 0.0f;
+    std::vector<std::uint32_t> keys_, order_, scratch_keys_, scratch_order_;
+    std::vector<float> px_, py_, pm_;
+
+    std::vector<Node> nodes_;
+    std::vector<std::vector<Node>> arenas_; // One per parallel subtree, reused between steps
+    std::vector<std::uint32_t> subtrees_;
+    std::vector<std::uint32_t> groups_; // The highest cells of at most group_size bodies
+
+    void sort(const float *x, const float *y, const float *mass, std::size_t count, WorkerPool &workers) {
+        float max_x = x[0], max_y = y[0];
+        min_x_ = x[0];
+        min_y_ = y[0];
+        for (std::size_t i = 1; i < count; ++i) {
+            min_x_ = std::min(min_x_, x[i]);
+            max_x = std::max(max_x, x[i]);
+            min_y_ = std::min(min_y_, y[i]);
+            max_y = std::max(max_y, y[i]);
+        }
+        // A square root cell, nudged so the largest coordinate still quantizes inside it
+        side_ = std::max(std::max(max_x - min_x_, max_y - min_y_), 1e-6f) * 1.0001f;
+
+        keys_.resize(count);
+        order_.resize(count);
+        const float scale = float(1u << LEVELS) / side_;
+        workers.parallel_for(count, 4096, [&](std::size_t begin, std::size_t end) {
+            for (std::size_t i = begin; i < end; ++i) {
+                const auto qx = std::min(static_cast<std::uint32_t>((x[i] - min_x_) * scale), (1u << LEVELS) - 1);
+                const auto qy = std::min(static_cast<std::uint32_t>((y[i] - min_y_) * scale), (1u << LEVELS) - 1);
+                keys_[i] = spread(qx) | spread(qy) << 1;
+                order_[i] = static_cast<std::uint32_t>(i);
+            }
+        });
+        radix_sort(workers);
+
+        px_.resize(count);
+        py_.resize(count);
+        pm_.resize(count);
+        workers.parallel_for(count, 4096, [&](std::size_t begin, std::size_t end) {
+            for (std::size_t i = begin; i < end; ++i) {
+                px_[i] = x[order_[i]];
+                py_[i] = y[order_[i]];
+                pm_[i] = mass[order_[i]];
+            }
+        });
+    }
+
+    // Bits of v moved to the even positions
+    static std::uint32_t spread(std::uint32_t v) {
+        v = (v | v << 8) & 0x00FF00FFu;
+        v = (v | v << 4) & 0x0F0F0F0Fu;
+        v = (v | v << 2) & 0x33333333u;
+        v = (v | v << 1) & 0x55555555u;
+        return v;
+    }
+
+    // LSD radix sort of (keys_, order_), 8 bits a pass. Each pass counts digits
+    // per fixed block in parallel, then every block scatters into its own
+    // precomputed slots, which keeps the sort stable.
+    void radix_sort(WorkerPool &workers) {
+        constexpr std::size_t BLOCK = 1 << 16;
+        const std::size_t count = keys_.size();
+        const std::size_t blocks = (count + BLOCK - 1) / BLOCK;
+        std::vector<std::uint32_t> counts(blocks * 256);
+        scratch_keys_.resize(count);
+        scratch_order_.resize(count);
+        for (int shift = 0; shift < 2 * LEVELS; shift += 8) {
+            std::fill(counts.begin(), counts.end(), 0);
+            workers.parallel_for(blocks, 1, [&](std::size_t first, std::size_t last) {
+                for (std::size_t b = first; b < last; ++b)
+                    for (std::size_t i = b * BLOCK; i < std::min(count, (b + 1) * BLOCK); ++i)
+                        ++counts[b * 256 + (keys_[i] >> shift & 0xFF)];
+            });
+            // Slots in digit-major, block-minor order
+            std::uint32_t total = 0;
+            for (std::size_t digit = 0; digit < 256; ++digit)
+                for (std::size_t b = 0; b < blocks; ++b) {
+                    const std::uint32_t n = counts[b * 256 + digit];
+                    counts[b * 256 + digit] = total;
+                    total += n;
+                }
+            workers.parallel_for(blocks, 1, [&](std::size_t first, std::size_t last) {
+                for (std::size_t b = first; b < last; ++b)
+                    for (std::size_t i = b * BLOCK; i < std::min(count, (b + 1) * BLOCK); ++i) {
+                        const std::uint32_t at = counts[b * 256 + (keys_[i] >> shift & 0xFF)]++;
+                        scratch_keys_[at] = keys_[i];
+                        scratch_order_[at] = order_[i];
+                    }
+            });
+            keys_.swap(scratch_keys_);
+            order_.swap(scratch_order_);
+        }
+    }
+
+    bool is_leaf(const Node &node) const {
+        return node.end - node.begin <= options_.leaf_size || node.level == LEVELS;
+    }
+
+    // Append the non-empty children of `node` to `nodes`
+    void split(std::vector<Node> &nodes, std::size_t at) const {
+        const Node node = nodes[at];
+        const int shift = 2 * (LEVELS - 1 - static_cast<int>(node.level));
+        nodes[at].first_child = static_cast<std::uint32_t>(nodes.size());
+        std::uint32_t begin = node.begin;
+        for (std::uint32_t quadrant = 0; quadrant < 4 && begin < node.end; ++quadrant) {
+            // Keys in the range share every digit above this level, so the
+            // quadrant is the next digit and the children split the range in order
+            const std::uint32_t end = static_cast<std::uint32_t>(
+                std::partition_point(keys_.begin() + begin, keys_.begin() + node.end,
+                                     [&](std::uint32_t key) { return (key >> shift & 3u) <= quadrant; }) -
+                keys_.begin());
+            if (end > begin)
+                nodes.push_back({0.0f, 0.0f, 0.0f, node.size * 0.5f, begin, end, 0, 0, node.level + 1});
+            begin = end;
+        }
+        nodes[at].child_count = static_cast<std::uint32_t>(nodes.size() - nodes[at].first_child);
+    }
+
+    // Mass and centre of mass of `nodes[at]`, from its bodies or its children
+    void summarize(std::vector<Node> &nodes, std::size_t at) const {
+        Node &node = nodes[at];
+        double mass = 0.0, mx = 0.0, my = 0.0;
+        if (!node.first_child) {
+            for (std::uint32_t i = node.begin; i < node.end; ++i) {
+                mass += pm_[i];
+                mx += double(pm_[i]) * px_[i];
+                my += double(pm_[i]) * py_[i];
+            }
+        } else {
+            for (std::uint32_t c = node.first_child; c < node.first_child + node.child_count; ++c) {
+                mass += nodes[c].mass;
+                mx += double(nodes[c].mass) * nodes[c].cx;
+                my += double(nodes[c].mass) * nodes[c].cy;
+            }
+        }
+        node.mass = static_cast<float>(mass);
+        // A massless cell still needs a finite position
+        node.cx = mass > 0.0 ? static_cast<float>(mx / mass) : px_[node.begin];
+        node.cy = mass > 0.0 ? static_cast<float>(my / mass) : py_[node.begin];
+    }
+
+    // Split the subtree rooted at nodes[0] all the way down, children after
+    // parents, then summarize it bottom up
+    void build_subtree(std::vector<Node> &nodes) const {
+        for (std::size_t at = 0; at < nodes.size(); ++at)
+            if (!is_leaf(nodes[at]))
+                split(nodes, at);
+        for (std::size_t at = nodes.size(); at-- > 0;)
+            summarize(nodes, at);
+    }
+
+    void build(WorkerPool &workers) {
+        const auto count = static_cast<std::uint32_t>(keys_.size());
+        nodes_.clear();
+        nodes_.push_back({0.0f, 0.0f, 0.0f, side_, 0, count, 0, 0, 0});
+
+        // Split the top serially until the ranges are small enough to share out
+        const std::size_t target = std::max<std::size_t>(options_.leaf_size, count / (workers.thread_count() * 8));
+        subtrees_.clear();
+        for (std::size_t at = 0; at < nodes_.size(); ++at) {
+            if (is_leaf(nodes_[at]))
+                continue;
+            if (nodes_[at].end - nodes_[at].begin > target)
+                split(nodes_, at);
+            else
+                subtrees_.push_back(static_cast<std::uint32_t>(at));
+        }
+        const std::size_t top = nodes_.size();
+        stats_.subtrees = subtrees_.size();
+
+        if (arenas_.size() < subtrees_.size())
+            arenas_.resize(subtrees_.size());
+        workers.parallel_for(subtrees_.size(), 1, [&](std::size_t first, std::size_t last) {
+            for (std::size_t s = first; s < last; ++s) {
+                std::vector<Node> &arena = arenas_[s];
+                arena.clear();
+                arena.push_back(nodes_[subtrees_[s]]);
+                build_subtree(arena);
+            }
+        });
+
+        // Splice: arena node k > 0 goes to base + k - 1, the root replaces the
+        // subtree's placeholder
+        std::vector<std::size_t> bases(subtrees_.size() + 1, top);
+        for (std::size_t s = 0; s < subtrees_.size(); ++s)
+            bases[s + 1] = bases[s] + arenas_[s].size() - 1;
+        nodes_.resize(bases.back());
+        workers.parallel_for(subtrees_.size(), 1, [&](std::size_t first, std::size_t last) {
+            for (std::size_t s = first; s < last; ++s) {
+                const std::vector<Node> &arena = arenas_[s];
+                const auto offset = static_cast<std::uint32_t>(bases[s] - 1);
+                for (std::size_t k = 0; k < arena.size(); ++k) {
+                    Node node = arena[k];
+                    if (node.first_child)
+                        node.first_child += offset;
+                    nodes_[k ? bases[s] + k - 1 : subtrees_[s]] = node;
+                }
+            }
+        });
+
+        // The top nodes' children all come after them
+        for (std::size_t at = top; at-- > 0;)
+            summarize(nodes_, at);
+
+        groups_.clear();
+        std::vector<std::uint32_t> stack(1, 0);
+        while (!stack.empty()) {
+            const Node &node = nodes_[stack.back()];
+            stack.pop_back();
+            if (!node.first_child || node.end - node.begin <= options_.group_size) {
+                groups_.push_back(static_cast<std::uint32_t>(&node - nodes_.data()));
+                continue;
+            }
+            for (std::uint32_t c = node.first_child; c < node.first_child + node.child_count; ++c)
+                stack.push_back(c);
+        }
+        stats_.nodes = nodes_.size();
+        stats_.groups = groups_.size();
+    }
+
+    void accelerate(float *ax, float *ay, WorkerPool &workers) {
+        const float theta2 = options_.theta * options_.theta;
+        const float eps2 = options_.softening * options_.softening;
+        std::atomic<std::size_t> interactions{0};
+        workers.parallel_for(groups_.size(), 4, [&](std::size_t first, std::size_t last) {
+            std::vector<float> lx, ly, lm;
+            std::vector<std::uint32_t> stack;
+            std::size_t block_interactions = 0;
+            for (std::size_t g = first; g < last; ++g) {
+                const Node &group = nodes_[groups_[g]];
+                float min_x = px_[group.begin], max_x = min_x, min_y = py_[group.begin], max_y = min_y;
+                for (std::uint32_t i = group.begin + 1; i < group.end; ++i) {
+                    min_x = std::min(min_x, px_[i]);
+                    max_x = std::max(max_x, px_[i]);
+                    min_y = std::min(min_y, py_[i]);
+                    max_y = std::max(max_y, py_[i]);
+                }
+
+                // One walk for the whole group: a cell is far enough if it is
+                // for every body in the group's bounds
+                lx.clear();
+                ly.clear();
+                lm.clear();
+                stack.assign(1, 0);
+                while (!stack.empty()) {
+                    const Node &node = nodes_[stack.back()];
+                    stack.pop_back();
+                    const float dx = std::max({min_x - node.cx, node.cx - max_x, 0.0f});
+                    const float dy = std::max({min_y - node.cy, node.cy - max_y, 0.0f});
+                    const float d2 = dx * dx + dy * dy;
+                    const bool ancestor = node.begin <= group.begin && group.end <= node.end;
+                    if (!ancestor && node.size * node.size < theta2 * d2) {
+                        lx.push_back(node.cx);
+                        ly.push_back(node.cy);
+                        lm.push_back(node.mass);
+                    } else if (!node.first_child) {
+                        // Includes the group's own leaves: a body's pull on itself is zero
+                        lx.insert(lx.end(), px_.begin() + node.begin, px_.begin() + node.end);
+                        ly.insert(ly.end(), py_.begin() + node.begin, py_.begin() + node.end);
+                        lm.insert(lm.end(), pm_.begin() + node.begin, pm_.begin() + node.end);
+                    } else {
+                        for (std::uint32_t c = node.first_child; c < node.first_child + node.child_count; ++c)
+                            stack.push_back(c);
+                    }
+                }
+                block_interactions += lx.size() * (group.end - group.begin);
+                // Massless padding to whole SIMD lanes
+                while (lx.size() % 4) {
+                    lx.push_back(0.0f);
+                    ly.push_back(0.0f);
+                    lm.push_back(0.0f);
+                }
+
+                for (std::uint32_t i = group.begin; i < group.end; ++i) {
+                    float fx, fy;
+                    sum(px_[i], py_[i], lx.data(), ly.data(), lm.data(), lx.size(), eps2, fx, fy);
+                    ax[order_[i]] = fx * options_.constant;
+                    ay[order_[i]] = fy * options_.constant;
+                }
+            }
+            interactions.fetch_add(block_interactions, std::memory_order_relaxed);
+        });
+        stats_.interactions = interactions;
+    }
+
+    // Sum of m (p - (x, y)) / (|p - (x, y)|² + eps2)^(3/2) over the list,
+    // `count` a multiple of four
+    static void sum(float x, float y, const float *lx, const float *ly, const float *lm, std::size_t count,
+                    float eps2, float &fx, float &fy) {
+#ifdef PIXELZ_BARNES_HUT_SSE
+        const __m128 x4 = _mm_set1_ps(x), y4 = _mm_set1_ps(y), eps4 = _mm_set1_ps(eps2);
+        const __m128 half = _mm_set1_ps(0.5f), three = _mm_set1_ps(3.0f);
+        __m128 ax = _mm_setzero_ps(), ay = _mm_setzero_ps();
+        for (std::size_t j = 0; j < count; j += 4) {
+            const __m128 dx = _mm_sub_ps(_mm_loadu_ps(lx + j), x4);
+            const __m128 dy = _mm_sub_ps(_mm_loadu_ps(ly + j), y4);
+            const __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), eps4);
+            // Approximate 1 / sqrt, refined with one Newton step to ~23 bits
+            __m128 inv = _mm_rsqrt_ps(r2);
+            inv = _mm_mul_ps(_mm_mul_ps(half, inv), _mm_sub_ps(three, _mm_mul_ps(_mm_mul_ps(r2, inv), inv)));
+            const __m128 s = _mm_mul_ps(_mm_loadu_ps(lm + j), _mm_mul_ps(_mm_mul_ps(inv, inv), inv));
+            ax = _mm_add_ps(ax, _mm_mul_ps(s, dx));
+            ay = _mm_add_ps(ay, _mm_mul_ps(s, dy));
+        }
+        alignas(16) float lanes_x[4], lanes_y[4];
+        _mm_store_ps(lanes_x, ax);
+        _mm_store_ps(lanes_y, ay);
+        fx = (lanes_x[0] + lanes_x[1]) + (lanes_x[2] + lanes_x[3]);
+        fy = (lanes_y[0] + lanes_y[1]) + (lanes_y[2] + lanes_y[3]);
+#else
+        fx = fy = 0.0f;
+        for (std::size_t j = 0; j < count; ++j) {
+            const float dx = lx[j] - x, dy = ly[j] - y;
+            const float r2 = dx * dx + dy * dy + eps2;
+            const float s = lm[j] / (r2 * std::sqrt(r2));
+            fx += s * dx;
+            fy += s * dy;
+        }
+#endif
+    }
+};
+
+} // namespace pixelz
+
+#endif
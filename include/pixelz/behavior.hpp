@@ -0,0 +1,252 @@
+// MIT License
+//
+// Copyright (c) 2022 Robert Blackwell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice (including the next
+// paragraph) shall be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF
+// OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef PIXELZ_BEHAVIOR_HPP
+#define PIXELZ_BEHAVIOR_HPP
+
+#include <algorithm>
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <utility>
+#include <vector>
+
+// Multi-frame behaviors written as coroutines:
+//
+//   Behavior blink(Entity e) {
+//       for (int i = 0; i < 3; ++i) {
+//           show(e);
+//           co_await seconds(0.5f);
+//           hide(e);
+//           co_await next_tick();
+//       }
+//   }
+//   scheduler.spawn(blink(e));
+//
+// Frames come from a size-class free list instead of the global heap, and a
+// BehaviorScheduler resumes whatever is ready once per tick. Everything here
+// is meant to be driven from the simulation thread only.
+namespace pixelz {
+
+// Free lists of coroutine frames in power-of-two size classes. Frames larger
+// than the biggest class fall back to the global heap.
+class CoroutineFramePool {
+  public:
+    static constexpr std::size_t MIN_CLASS = 64;
+    static constexpr std::size_t CLASS_COUNT = 6; // 64 .. 2048 bytes
+    static constexpr std::size_t BLOCKS_PER_SLAB = 64;
+
+    static void *allocate(std::size_t size) {
+        auto &pool = instance();
+        const std::size_t index = size_class(size);
+        if (index == CLASS_COUNT)
+            return ::operator new(size);
+        auto &free = pool.free_[index];
+        if (!free)
+            pool.grow(index);
+        Block *block = free;
+        free = block->next;
+        return block;
+    }
+
+    static void deallocate(void *frame, std::size_t size) {
+        auto &pool = instance();
+        const std::size_t index = size_class(size);
+        if (index == CLASS_COUNT) {
+            ::operator delete(frame);
+            return;
+        }
+        auto *block = static_cast<Block *>(frame);
+        block->next = pool.free_[index];
+        pool.free_[index] = block;
+    }
+
+  private:
+    struct Block {
+        Block *next;
+    };
+
+    std::array<Block *, CLASS_COUNT> free_{};
+
+    static CoroutineFramePool &instance() {
+        // Never destroyed, so behaviors owned by static objects can still free their frames at exit
+        static CoroutineFramePool *pool = new CoroutineFramePool;
+        return *pool;
+    }
+
+    static std::size_t size_class(std::size_t size) {
+        std::size_t index = 0;
+        for (std::size_t block = MIN_CLASS; block < size && index < CLASS_COUNT; block <<= 1)
+            ++index;
+        return index;
+    }
+
+    // Carve a slab into blocks for one size class
+    void grow(std::size_t index) {
+        const std::size_t block_size = MIN_CLASS << index;
+        auto *slab = static_cast<unsigned char *>(::operator new(block_size * BLOCKS_PER_SLAB));
+        for (std::size_t i = BLOCKS_PER_SLAB; i-- > 0;) {
+            auto *block = reinterpret_cast<Block *>(slab + i * block_size);
+            block->next = free_[index];
+            free_[index] = block;
+        }
+    }
+};
+
+class BehaviorScheduler;
+
+// Coroutine handle owned by a scheduler once spawned
+class Behavior {
+  public:
+    struct promise_type {
+        BehaviorScheduler *scheduler = nullptr;
+
+        Behavior get_return_object() { return Behavior(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        // Nothing runs until the scheduler first resumes it
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        // Stay suspended at the end so the scheduler can see it finished and free it
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        static void *operator new(std::size_t size) { return CoroutineFramePool::allocate(size); }
+        static void operator delete(void *frame, std::size_t size) { CoroutineFramePool::deallocate(frame, size); }
+    };
+
+    using Handle = std::coroutine_handle<promise_type>;
+
+    Behavior(Behavior &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+    Behavior &operator=(Behavior &&other) noexcept {
+        if (this != &other) {
+            if (handle_)
+                handle_.destroy();
+            handle_ = std::exchange(other.handle_, {});
+        }
+        return *this;
+    }
+    ~Behavior() {
+        if (handle_)
+            handle_.destroy();
+    }
+
+    // Give up ownership, the scheduler takes it from here
+    Handle release() { return std::exchange(handle_, {}); }
+
+  private:
+    explicit Behavior(Handle handle) : handle_(handle) {}
+    Handle handle_;
+};
+
+// Resumes behaviors in batches: everything waiting on the next tick plus every
+// timer that expired, once per tick(). Suspended behaviors cost nothing until
+// they become ready.
+class BehaviorScheduler {
+  public:
+    ~BehaviorScheduler() {
+        for (auto handle : next_)
+            handle.destroy();
+        for (auto const &timer : timers_)
+            timer.handle.destroy();
+    }
+
+    // Start a behavior. It first runs on the next tick().
+    void spawn(Behavior behavior) {
+        auto handle = behavior.release();
+        handle.promise().scheduler = this;
+        next_.push_back(handle);
+        ++live_;
+    }
+
+    // Advance the clock by dt and run every behavior that is ready
+    void tick(float dt) {
+        now_ += dt;
+
+        batch_.clear();
+        std::swap(batch_, next_);
+        while (!timers_.empty() && timers_.front().wake <= now_) {
+            std::pop_heap(timers_.begin(), timers_.end(), Timer::later);
+            batch_.push_back(timers_.back().handle);
+            timers_.pop_back();
+        }
+
+        for (auto handle : batch_) {
+            handle.resume();
+            if (handle.done()) {
+                handle.destroy();
+                --live_;
+            }
+        }
+    }
+
+    double now() const { return now_; }
+    std::size_t live_count() const { return live_; }
+
+    // Used by the awaitables
+    void wait_tick(Behavior::Handle handle) { next_.push_back(handle); }
+    void wait_until(Behavior::Handle handle, double wake) {
+        timers_.push_back({wake, handle});
+        std::push_heap(timers_.begin(), timers_.end(), Timer::later);
+    }
+
+  private:
+    struct Timer {
+        double wake;
+        Behavior::Handle handle;
+
+        static bool later(const Timer &a, const Timer &b) { return a.wake > b.wake; }
+    };
+
+    double now_ = 0.0;
+    std::size_t live_ = 0;
+    std::vector<Behavior::Handle> next_;
+    std::vector<Behavior::Handle> batch_;
+    std::vector<Timer> timers_; // Min-heap on wake time
+};
+
+// co_await next_tick(): resume on the following tick
+struct NextTick {
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(Behavior::Handle handle) const { handle.promise().scheduler->wait_tick(handle); }
+    void await_resume() const noexcept {}
+};
+
+inline NextTick next_tick() { return {}; }
+
+// co_await seconds(s): resume on the first tick at least s seconds from now
+struct Seconds {
+    double duration;
+
+    bool await_ready() const noexcept { return duration <= 0.0; }
+    void await_suspend(Behavior::Handle handle) const {
+        auto *scheduler = handle.promise().scheduler;
+        scheduler->wait_until(handle, scheduler->now() + duration);
+    }
+    void await_resume() const noexcept {}
+};
+
+inline Seconds seconds(double duration) { return {duration}; }
+
+} // namespace pixelz
+
+#endif
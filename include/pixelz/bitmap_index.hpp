@@ -0,0 +1,190 @@
+// MIT License
+//
+// Copyright (c) 2022 Robert Blackwell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice (including the next
+// paragraph) shall be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF
+// OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef PIXELZ_BITMAP_INDEX_HPP
+#define PIXELZ_BITMAP_INDEX_HPP
+
+#include <pixelz/page_ref.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PIXELZ_BITMAP_SSE 1
+#endif
+
+namespace pixelz {
+
+// Growable bitset with a one-level summary: summary bit j of word i says
+// whether word j of block i has any bit set, so intersections skip empty
+// 4096-bit blocks with one test. Blocks are shared copy-on-write between
+// copies, so copying a bitset costs O(blocks), and a block no bit was ever
+// set in takes no memory.
+class HierarchicalBitset {
+  public:
+    static constexpr std::size_t WORD_BITS = 64;
+    static constexpr std::size_t BLOCK_WORDS = 64; // Words covered by one summary word
+    static constexpr std::size_t BLOCK_BITS = WORD_BITS * BLOCK_WORDS;
+
+    bool test(std::size_t bit) const {
+        const std::size_t block = bit / BLOCK_BITS;
+        return block < blocks_.size() && blocks_[block].get() &&
+               (blocks_[block]->words[bit % BLOCK_BITS / WORD_BITS] >> (bit % WORD_BITS) & 1);
+    }
+
+    void set(std::size_t bit) {
+        const std::size_t block = bit / BLOCK_BITS;
+        if (block >= blocks_.size()) {
+            blocks_.resize(block + 1);
+            summary_.resize(block + 1, 0);
+        }
+        const std::size_t word = bit % BLOCK_BITS / WORD_BITS;
+        writable(block).words[word] |= std::uint64_t{1} << (bit % WORD_BITS);
+        summary_[block] |= std::uint64_t{1} << word;
+    }
+
+    void reset(std::size_t bit) {
+        const std::size_t block = bit / BLOCK_BITS;
+        if (block >= blocks_.size() || !blocks_[block].get())
+            return;
+        const std::size_t word = bit % BLOCK_BITS / WORD_BITS;
+        Block &words = writable(block);
+        words.words[word] &= ~(std::uint64_t{1} << (bit % WORD_BITS));
+        if (!words.words[word])
+            summary_[block] &= ~(std::uint64_t{1} << word);
+    }
+
+    void clear() {
+        for (auto &block : blocks_)
+            block.reset();
+        std::fill(summary_.begin(), summary_.end(), 0);
+    }
+
+    std::size_t count() const {
+        std::size_t total = 0;
+        for (auto const &block : blocks_)
+            if (block.get())
+                for (std::uint64_t word : block->words)
+                    total += static_cast<std::size_t>(__builtin_popcountll(word));
+        return total;
+    }
+
+    std::size_t block_count() const { return summary_.size(); }
+    // BLOCK_WORDS words of a block, all zero if no bit of it was ever set
+    // or it lies past the end
+    const std::uint64_t *block_words(std::size_t block) const {
+        alignas(16) static const std::uint64_t zeros[BLOCK_WORDS] = {};
+        return block < blocks_.size() && blocks_[block].get() ? blocks_[block]->words.data() : zeros;
+    }
+    const std::uint64_t *summary() const { return summary_.data(); }
+
+  private:
+    struct Block {
+        std::atomic<std::uint32_t> refs{1};
+        std::array<std::uint64_t, BLOCK_WORDS> words;
+
+        void recycle() {}
+    };
+
+    std::vector<PageRef<Block>> blocks_;
+    std::vector<std::uint64_t> summary_;
+
+    Block &writable(std::size_t block) {
+        PageRef<Block> &ref = blocks_[block];
+        if (!ref.get()) {
+            ref = PageRef<Block>::acquire();
+            ref->words.fill(0);
+        } else if (ref.shared()) {
+            auto copy = PageRef<Block>::acquire();
+            copy->words = ref->words;
+            ref = std::move(copy);
+        }
+        return *ref.get();
+    }
+};
+
+// Calls fn(bit) in ascending order for every bit set in all of `all` and in
+// none of `none`. `all` must not be empty. Summaries of `all` are ANDed first
+// to find the blocks worth looking at; blocks with many candidate words are
+// then ANDed whole, two words per SSE2 instruction, the rest word by word.
+template <typename F>
+void for_each_intersection(const HierarchicalBitset *const *all, std::size_t all_count,
+                           const HierarchicalBitset *const *none, std::size_t none_count, F &&fn) {
+    constexpr std::size_t BLOCK_WORDS = HierarchicalBitset::BLOCK_WORDS;
+    std::size_t blocks = all[0]->block_count();
+    for (std::size_t i = 1; i < all_count; ++i)
+        blocks = std::min(blocks, all[i]->block_count());
+
+    alignas(16) std::uint64_t scratch[BLOCK_WORDS];
+    for (std::size_t block = 0; block < blocks; ++block) {
+        std::uint64_t candidates = all[0]->summary()[block];
+        for (std::size_t i = 1; i < all_count && candidates; ++i)
+            candidates &= all[i]->summary()[block];
+        if (!candidates)
+            continue;
+
+        const std::size_t base = block * BLOCK_WORDS;
+        if (__builtin_popcountll(candidates) >= static_cast<int>(BLOCK_WORDS / 4)) {
+            // Dense block: AND the whole block, then walk the result
+            std::copy_n(all[0]->block_words(block), BLOCK_WORDS, scratch);
+            for (std::size_t i = 1; i < all_count + none_count; ++i) {
+                const bool negated = i >= all_count;
+                const std::uint64_t *words = negated ? none[i - all_count]->block_words(block) : all[i]->block_words(block);
+#ifdef PIXELZ_BITMAP_SSE
+                for (std::size_t w = 0; w < BLOCK_WORDS; w += 2) {
+                    const __m128i acc = _mm_load_si128(reinterpret_cast<const __m128i *>(scratch + w));
+                    const __m128i other = _mm_loadu_si128(reinterpret_cast<const __m128i *>(words + w));
+                    _mm_store_si128(reinterpret_cast<__m128i *>(scratch + w),
+                                    negated ? _mm_andnot_si128(other, acc) : _mm_and_si128(acc, other));
+                }
+#else
+                for (std::size_t w = 0; w < BLOCK_WORDS; ++w)
+                    scratch[w] &= negated ? ~words[w] : words[w];
+#endif
+            }
+            for (std::size_t w = 0; w < BLOCK_WORDS; ++w)
+                for (std::uint64_t bits = scratch[w]; bits; bits &= bits - 1)
+                    fn((base + w) * HierarchicalBitset::WORD_BITS + static_cast<std::size_t>(__builtin_ctzll(bits)));
+            continue;
+        }
+
+        for (; candidates; candidates &= candidates - 1) {
+            const std::size_t w = static_cast<std::size_t>(__builtin_ctzll(candidates));
+            std::uint64_t bits = all[0]->block_words(block)[w];
+            for (std::size_t i = 1; i < all_count; ++i)
+                bits &= all[i]->block_words(block)[w];
+            for (std::size_t i = 0; i < none_count; ++i)
+                bits &= ~none[i]->block_words(block)[w];
+            for (; bits; bits &= bits - 1)
+                fn((base + w) * HierarchicalBitset::WORD_BITS + static_cast<std::size_t>(__builtin_ctzll(bits)));
+        }
+    }
+}
+
+} // namespace pixelz
+
+#endif
@@ -0,0 +1,595 @@
+// MIT License
+//
+// Copyright (c) 2022 Robert Blackwell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice (including the next
+// paragraph) shall be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF
+// OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef PIXELZ_BVH_HPP
+#define PIXELZ_BVH_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PIXELZ_BVH_SSE 1
+#endif
+
+namespace pixelz {
+
+struct Aabb {
+    float min_x, min_y, max_x, max_y;
+
+    bool overlaps(const Aabb &o) const {
+        return min_x <= o.max_x && max_x >= o.min_x && min_y <= o.max_y && max_y >= o.min_y;
+    }
+    bool contains(const Aabb &o) const {
+        return min_x <= o.min_x && min_y <= o.min_y && max_x >= o.max_x && max_y >= o.max_y;
+    }
+    Aabb merged(const Aabb &o) const {
+        return {std::min(min_x, o.min_x), std::min(min_y, o.min_y), std::max(max_x, o.max_x), std::max(max_y, o.max_y)};
+    }
+    float area() const { return (max_x - min_x) * (max_y - min_y); }
+
+    static Aabb empty() {
+        constexpr float inf = std::numeric_limits<float>::infinity();
+        return {inf, inf, -inf, -inf};
+    }
+};
+
+struct Ray {
+    float origin_x, origin_y;
+    float dir_x, dir_y;
+    float max_t = std::numeric_limits<float>::infinity();
+};
+
+struct RayHit {
+    std::uint32_t id = UINT32_MAX; // UINT32_MAX if nothing was hit
+    float t = std::numeric_limits<float>::infinity();
+
+    explicit operator bool() const { return id != UINT32_MAX; }
+};
+
+// Bounding volume hierarchy with four children per node. Child bounds are
+// stored as structure-of-arrays so a node is tested against a query with one
+// set of 4-wide SIMD comparisons. Queries are const and can run concurrently.
+//
+// For moving boxes the tree can be kept up to date without rebuilding: nodes
+// are built around boxes enlarged by a margin ("fat" bounds), update() only
+// touches the tree when a box escapes its fat bounds, and refit() repairs the
+// affected nodes bottom-up, one tree level at a time. Refitting never changes
+// the topology, so the tree slowly loses quality and should be rebuilt now
+// and then.
+class Bvh4 {
+  public:
+    static constexpr std::uint32_t LEAF_SIZE = 4;
+    static constexpr std::uint32_t NO_SLOT = UINT32_MAX;
+
+    Bvh4() = default;
+    Bvh4(Bvh4 &&) = default;
+    Bvh4 &operator=(Bvh4 &&) = default;
+
+    // Copy between refits, when no node is queued
+    Bvh4(const Bvh4 &other)
+        : nodes_(other.nodes_), prims_(other.prims_), margin_(other.margin_), slot_of_id_(other.slot_of_id_),
+          prim_node_(other.prim_node_), parent_(other.parent_), levels_(other.levels_),
+          dirty_(std::make_unique<std::atomic<std::uint8_t>[]>(nodes_.size())) {}
+
+    Bvh4 &operator=(const Bvh4 &other) {
+        if (this != &other)
+            *this = Bvh4(other);
+        return *this;
+    }
+
+    // Build over n boxes with fat bounds `margin` larger on every side. Ids
+    // are reported back by queries and must be unique.
+    void build(const Aabb *boxes, const std::uint32_t *ids, std::size_t n, float margin = 0.0f) {
+        margin_ = margin;
+        prims_.resize(n);
+        for (std::size_t i = 0; i < n; ++i)
+            prims_[i] = {boxes[i], fatten(boxes[i]), ids[i]};
+        nodes_.clear();
+        if (n == 0) {
+            index_prims();
+            levels_.clear();
+            return;
+        }
+        nodes_.reserve(n / 2 + 1);
+        prim_node_.resize(n);
+        build_node(0, static_cast<std::uint32_t>(n));
+        index_prims();
+        index_levels();
+    }
+
+    std::size_t size() const { return prims_.size(); }
+    bool empty() const { return prims_.empty(); }
+    float margin() const { return margin_; }
+
+    bool contains_id(std::uint32_t id) const { return id < slot_of_id_.size() && slot_of_id_[id] != NO_SLOT; }
+
+    // Report the current box of `id`. If it left its fat bounds, they are
+    // re-fattened around it and its leaf is queued for refit(). Returns true
+    // in that case. Safe to call concurrently for distinct ids.
+    bool update(std::uint32_t id, const Aabb &box) {
+        const std::uint32_t slot = slot_of_id_[id];
+        prims_[slot].box = box;
+        if (prims_[slot].fat.contains(box))
+            return false;
+        prims_[slot].fat = fatten(box);
+        dirty_[prim_node_[slot]].store(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Repair node bounds after update(), deepest level first. Each level is
+    // handed to parallel_for(count, fn) with fn(begin, end), which may split
+    // it across threads since nodes on one level never share a child.
+    template <typename ParallelFor>
+    void refit(ParallelFor &&parallel_for) {
+        for (std::size_t level = levels_.size(); level-- > 0;) {
+            auto const &nodes = levels_[level];
+            parallel_for(nodes.size(), [&](std::size_t begin, std::size_t end) {
+                for (std::size_t i = begin; i < end; ++i)
+                    refit_node(nodes[i]);
+            });
+        }
+    }
+
+    void refit() {
+        refit([](std::size_t count, auto &&fn) { fn(std::size_t{0}, count); });
+    }
+
+    // Calls fn(id) for every box overlapping `region`
+    template <typename F>
+    void query_rect(const Aabb &region, F &&fn) const {
+        if (nodes_.empty())
+            return;
+        std::uint32_t stack[STACK_SIZE];
+        std::uint32_t top = 0;
+        stack[top++] = 0;
+        while (top) {
+            const Node &node = nodes_[stack[--top]];
+            int mask = overlap_mask(node, region) & node.valid;
+            for (; mask; mask &= mask - 1) {
+                const int slot = ctz(mask);
+                if (node.count[slot] == 0) {
+                    stack[top++] = node.child[slot];
+                    continue;
+                }
+                for (std::uint32_t i = node.child[slot], end = i + node.count[slot]; i < end; ++i)
+                    if (prims_[i].box.overlaps(region))
+                        fn(prims_[i].id);
+            }
+        }
+    }
+
+    // Calls fn(id) for every box within `radius` of (x, y)
+    template <typename F>
+    void query_radius(float x, float y, float radius, F &&fn) const {
+        if (nodes_.empty())
+            return;
+        const float radius2 = radius * radius;
+        std::uint32_t stack[STACK_SIZE];
+        std::uint32_t top = 0;
+        stack[top++] = 0;
+        while (top) {
+            const Node &node = nodes_[stack[--top]];
+            float d2[4];
+            distance2(node, x, y, d2);
+            for (int slot = 0; slot < 4; ++slot) {
+                if (!(node.valid & (1 << slot)) || d2[slot] > radius2)
+                    continue;
+                if (node.count[slot] == 0) {
+                    stack[top++] = node.child[slot];
+                    continue;
+                }
+                for (std::uint32_t i = node.child[slot], end = i + node.count[slot]; i < end; ++i)
+                    if (box_distance2(prims_[i].box, x, y) <= radius2)
+                        fn(prims_[i].id);
+            }
+        }
+    }
+
+    // The k boxes closest to (x, y), nearest first. Distance is zero inside a box.
+    void query_nearest(float x, float y, std::size_t k, std::vector<std::uint32_t> &out) const {
+        out.clear();
+        if (nodes_.empty() || k == 0)
+            return;
+
+        // Best-first: always expand the closest pending node
+        using Entry = std::pair<float, std::uint32_t>;
+        thread_local std::vector<Entry> pending;
+        thread_local std::vector<Entry> best; // Max-heap of the k closest so far
+        pending.clear();
+        best.clear();
+        auto farther = [](const Entry &a, const Entry &b) { return a.first > b.first; };
+        auto closer = [](const Entry &a, const Entry &b) { return a.first < b.first; };
+
+        pending.push_back({0.0f, 0});
+        while (!pending.empty()) {
+            std::pop_heap(pending.begin(), pending.end(), farther);
+            const Entry next = pending.back();
+            pending.pop_back();
+            if (best.size() == k && next.first > best.front().first)
+                break;
+
+            const Node &node = nodes_[next.second];
+            float d2[4];
+            distance2(node, x, y, d2);
+            for (int slot = 0; slot < 4; ++slot) {
+                if (!(node.valid & (1 << slot)) || (best.size() == k && d2[slot] > best.front().first))
+                    continue;
+                if (node.count[slot] == 0) {
+                    pending.push_back({d2[slot], static_cast<std::uint32_t>(node.child[slot])});
+                    std::push_heap(pending.begin(), pending.end(), farther);
+                    continue;
+                }
+                for (std::uint32_t i = node.child[slot], end = i + node.count[slot]; i < end; ++i) {
+                    const float d = box_distance2(prims_[i].box, x, y);
+                    if (best.size() < k) {
+                        best.push_back({d, prims_[i].id});
+                        std::push_heap(best.begin(), best.end(), closer);
+                    } else if (d < best.front().first) {
+                        std::pop_heap(best.begin(), best.end(), closer);
+                        best.back() = {d, prims_[i].id};
+                        std::push_heap(best.begin(), best.end(), closer);
+                    }
+                }
+            }
+        }
+
+        std::sort_heap(best.begin(), best.end(), closer);
+        for (auto const &entry : best)
+            out.push_back(entry.second);
+    }
+
+    // First box hit along the ray. A ray starting inside a box hits it at t = 0.
+    RayHit raycast(const Ray &ray) const {
+        RayHit hit;
+        hit.t = ray.max_t;
+        if (nodes_.empty())
+            return {};
+
+        const float inv_x = 1.0f / ray.dir_x;
+        const float inv_y = 1.0f / ray.dir_y;
+        std::uint32_t stack[STACK_SIZE];
+        std::uint32_t top = 0;
+        stack[top++] = 0;
+        while (top) {
+            const Node &node = nodes_[stack[--top]];
+            float entry[4];
+            int mask = ray_mask(node, ray, inv_x, inv_y, hit.t, entry) & node.valid;
+
+            // Push farther children first so the nearest is visited first
+            int order[4];
+            int count = 0;
+            for (; mask; mask &= mask - 1)
+                order[count++] = ctz(mask);
+            std::sort(order, order + count, [&](int a, int b) { return entry[a] > entry[b]; });
+
+            for (int n = 0; n < count; ++n) {
+                const int slot = order[n];
+                if (entry[slot] > hit.t)
+                    continue;
+                if (node.count[slot] == 0) {
+                    stack[top++] = node.child[slot];
+                    continue;
+                }
+                for (std::uint32_t i = node.child[slot], end = i + node.count[slot]; i < end; ++i) {
+                    float t;
+                    if (ray_box(prims_[i].box, ray, inv_x, inv_y, hit.t, t) && t < hit.t) {
+                        hit.t = t;
+                        hit.id = prims_[i].id;
+                    }
+                }
+            }
+        }
+        if (!hit)
+            hit.t = std::numeric_limits<float>::infinity();
+        return hit;
+    }
+
+  private:
+    static constexpr std::uint32_t STACK_SIZE = 256;
+
+    struct alignas(16) Node {
+        float min_x[4], min_y[4], max_x[4], max_y[4];
+        std::int32_t child[4];  // Node index for internal slots, first primitive for leaves
+        std::uint32_t count[4]; // Zero for internal slots, primitive count for leaves
+        int valid = 0;          // Bit per used slot
+    };
+
+    // Queries test the exact box, nodes are built around the fat one
+    struct Prim {
+        Aabb box;
+        Aabb fat;
+        std::uint32_t id;
+    };
+
+    std::vector<Node> nodes_;
+    std::vector<Prim> prims_;
+
+    // Refit bookkeeping
+    float margin_ = 0.0f;
+    std::vector<std::uint32_t> slot_of_id_;         // id -> index in prims_
+    std::vector<std::uint32_t> prim_node_;          // prims_ index -> node holding its leaf
+    std::vector<std::uint32_t> parent_;             // node -> parent node, NO_SLOT for the root
+    std::vector<std::vector<std::uint32_t>> levels_; // nodes by depth
+    std::unique_ptr<std::atomic<std::uint8_t>[]> dirty_;
+
+    static int ctz(int mask) { return __builtin_ctz(static_cast<unsigned>(mask)); }
+
+    Aabb fatten(const Aabb &box) const {
+        return {box.min_x - margin_, box.min_y - margin_, box.max_x + margin_, box.max_y + margin_};
+    }
+
+    void index_prims() {
+        std::uint32_t max_id = 0;
+        for (auto const &prim : prims_)
+            max_id = std::max(max_id, prim.id);
+        slot_of_id_.assign(prims_.empty() ? 0 : max_id + 1, NO_SLOT);
+        for (std::uint32_t slot = 0; slot < prims_.size(); ++slot)
+            slot_of_id_[prims_[slot].id] = slot;
+    }
+
+    void index_levels() {
+        parent_.assign(nodes_.size(), NO_SLOT);
+        levels_.clear();
+        levels_.push_back({0});
+        while (true) {
+            std::vector<std::uint32_t> next;
+            for (std::uint32_t node : levels_.back())
+                for (int slot = 0; slot < 4; ++slot)
+                    if ((nodes_[node].valid & (1 << slot)) && nodes_[node].count[slot] == 0) {
+                        const auto child = static_cast<std::uint32_t>(nodes_[node].child[slot]);
+                        parent_[child] = node;
+                        next.push_back(child);
+                    }
+            if (next.empty())
+                break;
+            levels_.push_back(std::move(next));
+        }
+        dirty_ = std::make_unique<std::atomic<std::uint8_t>[]>(nodes_.size());
+    }
+
+    void refit_node(std::uint32_t index) {
+        if (!dirty_[index].load(std::memory_order_relaxed))
+            return;
+        dirty_[index].store(0, std::memory_order_relaxed);
+
+        Node &node = nodes_[index];
+        bool changed = false;
+        for (int slot = 0; slot < 4; ++slot) {
+            if (!(node.valid & (1 << slot)))
+                continue;
+            Aabb bounds = Aabb::empty();
+            if (node.count[slot]) {
+                for (std::uint32_t i = node.child[slot], end = i + node.count[slot]; i < end; ++i)
+                    bounds = bounds.merged(prims_[i].fat);
+            } else {
+                const Node &child = nodes_[node.child[slot]];
+                for (int c = 0; c < 4; ++c)
+                    if (child.valid & (1 << c))
+                        bounds = bounds.merged({child.min_x[c], child.min_y[c], child.max_x[c], child.max_y[c]});
+            }
+            if (bounds.min_x != node.min_x[slot] || bounds.min_y != node.min_y[slot] ||
+                bounds.max_x != node.max_x[slot] || bounds.max_y != node.max_y[slot]) {
+                node.min_x[slot] = bounds.min_x;
+                node.min_y[slot] = bounds.min_y;
+                node.max_x[slot] = bounds.max_x;
+                node.max_y[slot] = bounds.max_y;
+                changed = true;
+            }
+        }
+        if (changed && parent_[index] != NO_SLOT)
+            dirty_[parent_[index]].store(1, std::memory_order_relaxed);
+    }
+
+    static float box_distance2(const Aabb &box, float x, float y) {
+        const float dx = std::max({box.min_x - x, 0.0f, x - box.max_x});
+        const float dy = std::max({box.min_y - y, 0.0f, y - box.max_y});
+        return dx * dx + dy * dy;
+    }
+
+    // Interval [t0, t1] of the ray inside the slab lo..hi of one axis. A ray
+    // parallel to the slab is inside along its whole length or not at all;
+    // it is handled apart because (lo - origin) * inv would be 0 * inf = NaN
+    // for an origin on the slab's plane.
+    static void slab(float lo, float hi, float origin, float dir, float inv, float &t0, float &t1) {
+        constexpr float INF = std::numeric_limits<float>::infinity();
+        if (dir == 0.0f) {
+            const bool inside = lo <= origin && origin <= hi;
+            t0 = inside ? -INF : INF;
+            t1 = -t0;
+            return;
+        }
+        t0 = (lo - origin) * inv;
+        t1 = (hi - origin) * inv;
+        if (t0 > t1)
+            std::swap(t0, t1);
+    }
+
+    static bool ray_box(const Aabb &box, const Ray &ray, float inv_x, float inv_y, float max_t, float &t) {
+        float tx1, tx2, ty1, ty2;
+        slab(box.min_x, box.max_x, ray.origin_x, ray.dir_x, inv_x, tx1, tx2);
+        slab(box.min_y, box.max_y, ray.origin_y, ray.dir_y, inv_y, ty1, ty2);
+        const float near = std::max({tx1, ty1, 0.0f});
+        const float far = std::min({tx2, ty2, max_t});
+        t = near;
+        return near <= far;
+    }
+
+#ifdef PIXELZ_BVH_SSE
+    static int overlap_mask(const Node &node, const Aabb &q) {
+        const __m128 a = _mm_cmple_ps(_mm_load_ps(node.min_x), _mm_set1_ps(q.max_x));
+        const __m128 b = _mm_cmpge_ps(_mm_load_ps(node.max_x), _mm_set1_ps(q.min_x));
+        const __m128 c = _mm_cmple_ps(_mm_load_ps(node.min_y), _mm_set1_ps(q.max_y));
+        const __m128 d = _mm_cmpge_ps(_mm_load_ps(node.max_y), _mm_set1_ps(q.min_y));
+        return _mm_movemask_ps(_mm_and_ps(_mm_and_ps(a, b), _mm_and_ps(c, d)));
+    }
+
+    static void distance2(const Node &node, float x, float y, float *out) {
+        const __m128 px = _mm_set1_ps(x), py = _mm_set1_ps(y), zero = _mm_setzero_ps();
+        const __m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_load_ps(node.min_x), px), zero),
+                                     _mm_sub_ps(px, _mm_load_ps(node.max_x)));
+        const __m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_load_ps(node.min_y), py), zero),
+                                     _mm_sub_ps(py, _mm_load_ps(node.max_y)));
+        _mm_storeu_ps(out, _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)));
+    }
+
+    // slab() for four boxes
+    static void slab(__m128 lo, __m128 hi, float origin, float dir, float inv, __m128 &t0, __m128 &t1) {
+        const __m128 o = _mm_set1_ps(origin);
+        if (dir == 0.0f) {
+            const __m128 inside = _mm_and_ps(_mm_cmple_ps(lo, o), _mm_cmple_ps(o, hi));
+            const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+            const __m128 sign = _mm_set1_ps(-0.0f);
+            t0 = _mm_xor_ps(inf, _mm_and_ps(inside, sign)); // -inf inside, +inf outside
+            t1 = _mm_xor_ps(t0, sign);
+            return;
+        }
+        const __m128 i = _mm_set1_ps(inv);
+        const __m128 a = _mm_mul_ps(_mm_sub_ps(lo, o), i), b = _mm_mul_ps(_mm_sub_ps(hi, o), i);
+        t0 = _mm_min_ps(a, b);
+        t1 = _mm_max_ps(a, b);
+    }
+
+    static int ray_mask(const Node &node, const Ray &ray, float inv_x, float inv_y, float max_t, float *entry) {
+        __m128 tx1, tx2, ty1, ty2;
+        slab(_mm_load_ps(node.min_x), _mm_load_ps(node.max_x), ray.origin_x, ray.dir_x, inv_x, tx1, tx2);
+        slab(_mm_load_ps(node.min_y), _mm_load_ps(node.max_y), ray.origin_y, ray.dir_y, inv_y, ty1, ty2);
+        const __m128 near = _mm_max_ps(_mm_max_ps(tx1, ty1), _mm_setzero_ps());
+        const __m128 far = _mm_min_ps(_mm_min_ps(tx2, ty2), _mm_set1_ps(max_t));
+        _mm_storeu_ps(entry, near);
+        return _mm_movemask_ps(_mm_cmple_ps(near, far));
+    }
+#else
+    static int overlap_mask(const Node &node, const Aabb &q) {
+        int mask = 0;
+        for (int i = 0; i < 4; ++i)
+            mask |= (node.min_x[i] <= q.max_x && node.max_x[i] >= q.min_x && node.min_y[i] <= q.max_y &&
+                     node.max_y[i] >= q.min_y)
+                    << i;
+        return mask;
+    }
+
+    static void distance2(const Node &node, float x, float y, float *out) {
+        for (int i = 0; i < 4; ++i)
+            out[i] = box_distance2({node.min_x[i], node.min_y[i], node.max_x[i], node.max_y[i]}, x, y);
+    }
+
+    static int ray_mask(const Node &node, const Ray &ray, float inv_x, float inv_y, float max_t, float *entry) {
+        int mask = 0;
+        for (int i = 0; i < 4; ++i)
+            mask |= ray_box({node.min_x[i], node.min_y[i], node.max_x[i], node.max_y[i]}, ray, inv_x, inv_y, max_t,
+                            entry[i])
+                    << i;
+        return mask;
+    }
+#endif
+
+    Aabb range_bounds(std::uint32_t begin, std::uint32_t end) const {
+        Aabb bounds = Aabb::empty();
+        for (std::uint32_t i = begin; i < end; ++i)
+            bounds = bounds.merged(prims_[i].fat);
+        return bounds;
+    }
+
+    // Median split along the axis with the largest centroid spread
+    std::uint32_t split(std::uint32_t begin, std::uint32_t end) {
+        Aabb centroids = Aabb::empty();
+        for (std::uint32_t i = begin; i < end; ++i) {
+            const float cx = prims_[i].box.min_x + prims_[i].box.max_x;
+            const float cy = prims_[i].box.min_y + prims_[i].box.max_y;
+            centroids = centroids.merged({cx, cy, cx, cy});
+        }
+        const bool along_x = centroids.max_x - centroids.min_x >= centroids.max_y - centroids.min_y;
+        const std::uint32_t middle = begin + (end - begin) / 2;
+        std::nth_element(prims_.begin() + begin, prims_.begin() + middle, prims_.begin() + end,
+                         [along_x](const Prim &a, const Prim &b) {
+                             return along_x ? a.box.min_x + a.box.max_x < b.box.min_x + b.box.max_x
+                                            : a.box.min_y + a.box.max_y < b.box.min_y + b.box.max_y;
+                         });
+        return middle;
+    }
+
+    std::uint32_t build_node(std::uint32_t begin, std::uint32_t end) {
+        const auto index = static_cast<std::uint32_t>(nodes_.size());
+        nodes_.emplace_back();
+
+        // Split the largest group until there are four or nothing is left to split
+        std::pair<std::uint32_t, std::uint32_t> groups[4] = {{begin, end}};
+        int group_count = 1;
+        while (group_count < 4) {
+            int largest = 0;
+            for (int g = 1; g < group_count; ++g)
+                if (groups[g].second - groups[g].first > groups[largest].second - groups[largest].first)
+                    largest = g;
+            auto [b, e] = groups[largest];
+            if (e - b <= LEAF_SIZE)
+                break;
+            const std::uint32_t middle = split(b, e);
+            groups[largest] = {b, middle};
+            groups[group_count++] = {middle, e};
+        }
+
+        for (int slot = 0; slot < 4; ++slot) {
+            Node &node = nodes_[index];
+            if (slot >= group_count) {
+                node.min_x[slot] = node.min_y[slot] = std::numeric_limits<float>::infinity();
+                node.max_x[slot] = node.max_y[slot] = -std::numeric_limits<float>::infinity();
+                node.child[slot] = -1;
+                node.count[slot] = 0;
+                continue;
+            }
+            auto [b, e] = groups[slot];
+            const Aabb bounds = range_bounds(b, e);
+            std::int32_t child;
+            std::uint32_t count;
+            if (e - b <= LEAF_SIZE) {
+                child = static_cast<std::int32_t>(b);
+                count = e - b;
+                for (std::uint32_t i = b; i < e; ++i)
+                    prim_node_[i] = index;
+            } else {
+                child = static_cast<std::int32_t>(build_node(b, e));
+                count = 0;
+            }
+            // build_node may have reallocated nodes_
+            Node &filled = nodes_[index];
+            filled.min_x[slot] = bounds.min_x;
+            filled.min_y[slot] = bounds.min_y;
+            filled.max_x[slot] = bounds.max_x;
+            filled.max_y[slot] = bounds.max_y;
+            filled.child[slot] = child;
+            filled.count[slot] = count;
+            filled.valid |= 1 << slot;
+        }
+        return index;
+    }
+};
+
+} // namespace pixelz
+
+#endif
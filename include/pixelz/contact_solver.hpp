@@ -0,0 +1,266 @@
+// MIT License
+//
+// Copyright (c) 2022 Robert Blackwell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice (including the next
+// paragraph) shall be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF
+// OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef PIXELZ_CONTACT_SOLVER_HPP
+#define PIXELZ_CONTACT_SOLVER_HPP
+
+#include <pixelz/parallel.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PIXELZ_SOLVER_SSE 1
+#endif
+
+namespace pixelz {
+
+// Non-penetration constraints between pairs of bodies, solved with
+// projected Gauss-Seidel on velocities. Contacts are greedily colored so no
+// two contacts of a color share a body; each color is then one batch whose
+// contacts are independent, solved in parallel on a WorkerPool and four at a
+// time in SIMD lanes. The result does not depend on the thread count.
+//
+// Accumulated impulses are kept between frames by contact key, and a contact
+// that persists starts from last frame's impulse (warm starting), which is
+// what lets stacks settle in a few iterations. When a frame is sub-stepped,
+// the accumulated impulse is the one for a single sub-step, and it is applied
+// again at the start of every sub-step.
+class ContactSolver {
+  public:
+    static constexpr std::uint32_t MAX_COLORS = 32; // Contacts beyond this many colors are solved serially
+
+    struct Options {
+        int iterations = 4;      // Per solve()
+        float baumgarte = 0.2f;  // Fraction of the penetration removed per frame
+        float slop = 0.05f;      // Penetration tolerated without correction
+    };
+
+    // Unit normal (nx, ny) points from body a to body b. The key must be
+    // stable across frames for the same pair, e.g. both entity ids.
+    struct Contact {
+        std::uint32_t a, b;
+        float nx, ny;
+        float depth;
+        std::uint64_t key;
+    };
+
+    void set_options(const Options &options) { options_ = options; }
+
+    // Set up this frame's contacts, in any order. Reorders `contacts`.
+    void prepare(std::vector<Contact> &contacts, const float *inv_mass, std::size_t body_count, float dt) {
+        color(contacts, body_count);
+
+        const std::size_t n = contacts.size();
+        a_.resize(n);
+        b_.resize(n);
+        nx_.resize(n);
+        ny_.resize(n);
+        inv_a_.resize(n);
+        inv_b_.resize(n);
+        mass_.resize(n);
+        bias_.resize(n);
+        impulse_.resize(n);
+        keys_.resize(n);
+
+        for (std::size_t i = 0; i < n; ++i) {
+            const Contact &c = contacts[i];
+            a_[i] = c.a;
+            b_[i] = c.b;
+            nx_[i] = c.nx;
+            ny_[i] = c.ny;
+            inv_a_[i] = inv_mass[c.a];
+            inv_b_[i] = inv_mass[c.b];
+            const float inv_sum = inv_a_[i] + inv_b_[i];
+            mass_[i] = inv_sum > 0.0f ? 1.0f / inv_sum : 0.0f;
+            bias_[i] = dt > 0.0f ? options_.baumgarte * std::max(c.depth - options_.slop, 0.0f) / dt : 0.0f;
+            keys_[i] = c.key;
+        }
+        warm_impulses();
+    }
+
+    // Apply the accumulated impulses: last frame's after prepare(), the last
+    // sub-step's after solve(). Call it before every solve().
+    void warm_start(float *vx, float *vy) const {
+        for (std::size_t i = 0; i < a_.size(); ++i)
+            apply(i, impulse_[i], vx, vy);
+    }
+
+    // Run Options::iterations passes over every batch
+    void solve(float *vx, float *vy, WorkerPool &workers) {
+        for (int iteration = 0; iteration < options_.iterations; ++iteration) {
+            for (std::size_t color = 0; color + 1 < batch_begin_.size(); ++color) {
+                const std::size_t begin = batch_begin_[color];
+                const std::size_t count = batch_begin_[color + 1] - begin;
+                if (color == MAX_COLORS) {
+                    // Leftovers may share bodies, so they go one at a time
+                    for (std::size_t i = begin; i < begin + count; ++i)
+                        solve_one(i, vx, vy);
+                    continue;
+                }
+                workers.parallel_for(count, GRAIN, [&](std::size_t first, std::size_t last) {
+                    solve_range(begin + first, begin + last, vx, vy);
+                });
+            }
+        }
+    }
+
+    // Remember this frame's impulses for the next prepare()
+    void finish() {
+        cache_.resize(keys_.size());
+        for (std::size_t i = 0; i < keys_.size(); ++i)
+            cache_[i] = {keys_[i], impulse_[i], nx_[i], ny_[i]};
+        std::sort(cache_.begin(), cache_.end(), [](const Cached &x, const Cached &y) { return x.key < y.key; });
+    }
+
+    std::size_t contact_count() const { return a_.size(); }
+    std::size_t color_count() const { return batch_begin_.empty() ? 0 : batch_begin_.size() - 1; }
+
+  private:
+    static constexpr std::size_t GRAIN = 256; // Contacts per parallel block, a multiple of the SIMD width
+
+    struct Cached {
+        std::uint64_t key;
+        float impulse;
+        float nx, ny;
+    };
+
+    Options options_;
+
+    // This frame's contacts, structure of arrays, grouped by color
+    std::vector<std::uint32_t> a_, b_;
+    std::vector<float> nx_, ny_, inv_a_, inv_b_, mass_, bias_, impulse_;
+    std::vector<std::uint64_t> keys_;
+    std::vector<std::size_t> batch_begin_; // Color c is [batch_begin_[c], batch_begin_[c + 1])
+
+    std::vector<Cached> cache_; // Last frame's impulses, sorted by key
+    std::vector<std::uint32_t> used_colors_;
+    std::vector<std::uint8_t> contact_color_;
+    std::vector<Contact> scratch_;
+    std::vector<std::size_t> counts_, next_, order_; // Reused by color() and warm_impulses()
+
+    // Greedy coloring: each contact takes the lowest color neither body has yet
+    void color(std::vector<Contact> &contacts, std::size_t body_count) {
+        used_colors_.assign(body_count, 0);
+        contact_color_.resize(contacts.size());
+        counts_.assign(MAX_COLORS + 1, 0);
+        for (std::size_t i = 0; i < contacts.size(); ++i) {
+            const std::uint32_t used = used_colors_[contacts[i].a] | used_colors_[contacts[i].b];
+            const std::uint32_t color = ~used ? static_cast<std::uint32_t>(__builtin_ctz(~used)) : MAX_COLORS;
+            if (color < MAX_COLORS) {
+                used_colors_[contacts[i].a] |= 1u << color;
+                used_colors_[contacts[i].b] |= 1u << color;
+            }
+            contact_color_[i] = static_cast<std::uint8_t>(color);
+            ++counts_[color];
+        }
+
+        // Counting sort into batches, keeping the input order within each
+        std::size_t colors = MAX_COLORS + 1;
+        while (colors > 0 && counts_[colors - 1] == 0)
+            --colors;
+        batch_begin_.assign(colors + 1, 0);
+        for (std::size_t c = 0; c < colors; ++c)
+            batch_begin_[c + 1] = batch_begin_[c] + counts_[c];
+        scratch_.resize(contacts.size());
+        next_.assign(batch_begin_.begin(), batch_begin_.end() - 1);
+        for (std::size_t i = 0; i < contacts.size(); ++i)
+            scratch_[next_[contact_color_[i]]++] = contacts[i];
+        contacts.swap(scratch_);
+    }
+
+    // Look every key up in last frame's cache with one sorted merge. An
+    // impulse is only reused if the pair still touches along the same normal.
+    void warm_impulses() {
+        order_.resize(keys_.size());
+        for (std::size_t i = 0; i < order_.size(); ++i)
+            order_[i] = i;
+        std::sort(order_.begin(), order_.end(), [&](std::size_t x, std::size_t y) { return keys_[x] < keys_[y]; });
+        std::size_t at = 0;
+        for (std::size_t i : order_) {
+            while (at < cache_.size() && cache_[at].key < keys_[i])
+                ++at;
+            const bool same = at < cache_.size() && cache_[at].key == keys_[i] && cache_[at].nx == nx_[i] &&
+                              cache_[at].ny == ny_[i];
+            impulse_[i] = same ? cache_[at].impulse : 0.0f;
+        }
+    }
+
+    void apply(std::size_t i, float impulse, float *vx, float *vy) const {
+        const float px = impulse * nx_[i], py = impulse * ny_[i];
+        vx[a_[i]] -= px * inv_a_[i];
+        vy[a_[i]] -= py * inv_a_[i];
+        vx[b_[i]] += px * inv_b_[i];
+        vy[b_[i]] += py * inv_b_[i];
+    }
+
+    void solve_one(std::size_t i, float *vx, float *vy) {
+        const float vn = (vx[b_[i]] - vx[a_[i]]) * nx_[i] + (vy[b_[i]] - vy[a_[i]]) * ny_[i];
+        const float total = std::max(impulse_[i] + (bias_[i] - vn) * mass_[i], 0.0f);
+        apply(i, total - impulse_[i], vx, vy);
+        impulse_[i] = total;
+    }
+
+    void solve_range(std::size_t begin, std::size_t end, float *vx, float *vy) {
+        std::size_t i = begin;
+#ifdef PIXELZ_SOLVER_SSE
+        // Four contacts of one color never share a body, so their lanes are independent
+        for (; i + 4 <= end; i += 4) {
+            const std::uint32_t *a = &a_[i], *b = &b_[i];
+            const __m128 rvx = _mm_setr_ps(vx[b[0]] - vx[a[0]], vx[b[1]] - vx[a[1]], vx[b[2]] - vx[a[2]],
+                                           vx[b[3]] - vx[a[3]]);
+            const __m128 rvy = _mm_setr_ps(vy[b[0]] - vy[a[0]], vy[b[1]] - vy[a[1]], vy[b[2]] - vy[a[2]],
+                                           vy[b[3]] - vy[a[3]]);
+            const __m128 nx = _mm_loadu_ps(&nx_[i]), ny = _mm_loadu_ps(&ny_[i]);
+            const __m128 vn = _mm_add_ps(_mm_mul_ps(rvx, nx), _mm_mul_ps(rvy, ny));
+            const __m128 old = _mm_loadu_ps(&impulse_[i]);
+            const __m128 total = _mm_max_ps(
+                _mm_add_ps(old, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&bias_[i]), vn), _mm_loadu_ps(&mass_[i]))),
+                _mm_setzero_ps());
+            _mm_storeu_ps(&impulse_[i], total);
+            const __m128 delta = _mm_sub_ps(total, old);
+            const __m128 px = _mm_mul_ps(delta, nx), py = _mm_mul_ps(delta, ny);
+            alignas(16) float dax[4], day[4], dbx[4], dby[4];
+            const __m128 inv_a = _mm_loadu_ps(&inv_a_[i]), inv_b = _mm_loadu_ps(&inv_b_[i]);
+            _mm_store_ps(dax, _mm_mul_ps(px, inv_a));
+            _mm_store_ps(day, _mm_mul_ps(py, inv_a));
+            _mm_store_ps(dbx, _mm_mul_ps(px, inv_b));
+            _mm_store_ps(dby, _mm_mul_ps(py, inv_b));
+            for (int lane = 0; lane < 4; ++lane) {
+                vx[a[lane]] -= dax[lane];
+                vy[a[lane]] -= day[lane];
+                vx[b[lane]] += dbx[lane];
+                vy[b[lane]] += dby[lane];
+            }
+        }
+#endif
+        for (; i < end; ++i)
+            solve_one(i, vx, vy);
+    }
+};
+
+} // namespace pixelz
+
+#endif
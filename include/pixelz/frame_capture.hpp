@@ -0,0 +1,242 @@
+// MIT License
+//
+// Copyright (c) 2022 Robert Blackwell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice (including the next
+// paragraph) shall be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF
+// OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef PIXELZ_FRAME_CAPTURE_HPP
+#define PIXELZ_FRAME_CAPTURE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Video capture that never stalls the frame loop:
+//
+//   FrameWriter writer("run.y4m", width, height, 60);
+//   ...every frame...
+//   writer.submit(rgba_pixels);
+//
+// Frames are copied into a ring of buffers allocated up front, and a
+// background thread converts and writes them. If the writer falls behind and
+// the ring is full, the frame is dropped and counted instead of waiting.
+// Destroying a writer waits for the queued frames; to stop without waiting,
+// call finish() and destroy it once done().
+namespace pixelz {
+
+class FrameWriter {
+  public:
+    enum class Format {
+        Y4M,  // YUV4MPEG2, 4:4:4, playable by ffmpeg/mpv as is
+        RGBA, // Raw frames back to back, e.g. ffmpeg -f rawvideo -pix_fmt rgba -s WxH
+    };
+
+    struct Stats {
+        std::size_t submitted = 0;
+        std::size_t written = 0;
+        std::size_t dropped = 0;
+    };
+
+    // `path` names a file, or a command to pipe into when it starts with '|',
+    // e.g. "|ffmpeg -y -i - run.mp4"
+    FrameWriter(const std::string &path, int width, int height, int fps, Format format = Format::Y4M,
+                std::size_t ring_size = 8)
+        : width_(width), height_(height), format_(format), frame_bytes_(std::size_t(width) * height * 4),
+          ring_(std::max<std::size_t>(ring_size, 2)) {
+        for (auto &slot : ring_)
+            slot.resize(frame_bytes_);
+        if (!path.empty() && path[0] == '|') {
+#ifdef _WIN32
+            file_ = _popen(path.c_str() + 1, "wb");
+#else
+            file_ = popen(path.c_str() + 1, "w");
+#endif
+            pipe_ = true;
+        } else {
+            file_ = std::fopen(path.c_str(), "wb");
+        }
+        if (!file_)
+            return;
+        if (format_ == Format::Y4M)
+            std::fprintf(file_, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width_, height_, fps);
+        thread_ = std::thread([this] { write_loop(); });
+    }
+
+    // The writer thread owns the file once started and closes it on the way out
+    ~FrameWriter() {
+        if (thread_.joinable()) {
+            // Let the writer finish what is queued
+            finish();
+            thread_.join();
+        }
+    }
+
+    FrameWriter(const FrameWriter &) = delete;
+    FrameWriter &operator=(const FrameWriter &) = delete;
+
+    bool ok() const { return file_ && !failed_.load(std::memory_order_relaxed); }
+
+    // Stop taking frames and let the writer thread write out the queued ones
+    // on its own
+    void finish() {
+        stopping_.store(true, std::memory_order_release);
+        wake_.fetch_add(1, std::memory_order_release);
+        wake_.notify_one();
+    }
+
+    // After finish(): every queued frame is written and the file closed (for
+    // a pipe, the command has exited), so destroying the writer won't block
+    bool done() const { return !thread_.joinable() || finished_.load(std::memory_order_acquire); }
+
+    // Queue a width x height RGBA frame, `rgba` pointing at the top row and
+    // rows `stride` bytes apart (0 means tightly packed). A negative stride
+    // reads bottom-up rows, e.g. from glReadPixels, starting at the last one.
+    // Returns false if it was dropped.
+    bool submit(const std::uint8_t *rgba, std::ptrdiff_t stride = 0) {
+        ++submitted_;
+        const std::size_t head = head_.load(std::memory_order_relaxed);
+        // After finish() the writer thread may be freeing the ring, so test that first
+        if (stopping_.load(std::memory_order_relaxed) || !ok() ||
+            head - tail_.load(std::memory_order_acquire) == ring_.size()) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        const std::size_t row = std::size_t(width_) * 4;
+        if (!stride)
+            stride = static_cast<std::ptrdiff_t>(row);
+        std::uint8_t *slot = ring_[head % ring_.size()].data();
+        if (stride == static_cast<std::ptrdiff_t>(row))
+            std::memcpy(slot, rgba, frame_bytes_);
+        else
+            for (int y = 0; y < height_; ++y)
+                std::memcpy(slot + y * row, rgba + y * stride, row);
+
+        head_.store(head + 1, std::memory_order_release);
+        wake_.fetch_add(1, std::memory_order_release);
+        wake_.notify_one();
+        return true;
+    }
+
+    // As above for a frame of the given size. One that does not match the
+    // stream, e.g. after a window resize, is counted as dropped.
+    bool submit(const std::uint8_t *rgba, int width, int height, std::ptrdiff_t stride = 0) {
+        if (width != width_ || height != height_) {
+            ++submitted_;
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        return submit(rgba, stride);
+    }
+
+    Stats stats() const {
+        return {submitted_, written_.load(std::memory_order_relaxed), dropped_.load(std::memory_order_relaxed)};
+    }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+
+  private:
+    int width_;
+    int height_;
+    Format format_;
+    std::size_t frame_bytes_;
+    std::vector<std::vector<std::uint8_t>> ring_;
+    std::vector<std::uint8_t> planes_; // Y4M conversion, writer thread only
+
+    std::FILE *file_ = nullptr;
+    bool pipe_ = false;
+    std::thread thread_;
+
+    // Single producer, single consumer: slots [tail_, head_) are queued
+    std::atomic<std::size_t> head_{0};
+    std::atomic<std::size_t> tail_{0};
+    std::atomic<std::uint32_t> wake_{0};
+    std::atomic<bool> stopping_{false};
+    std::atomic<bool> failed_{false};
+    std::atomic<bool> finished_{false}; // The writer thread has returned
+
+    std::size_t submitted_ = 0; // Producer thread only
+    std::atomic<std::size_t> written_{0};
+    std::atomic<std::size_t> dropped_{0};
+
+    void write_loop() {
+        std::size_t tail = 0;
+        for (;;) {
+            const std::uint32_t seen = wake_.load(std::memory_order_acquire);
+            const std::size_t head = head_.load(std::memory_order_acquire);
+            if (tail == head) {
+                if (stopping_.load(std::memory_order_acquire)) {
+                    // Hand the memory back here rather than on whichever thread destroys the writer
+                    std::vector<std::vector<std::uint8_t>>().swap(ring_);
+                    std::vector<std::uint8_t>().swap(planes_);
+#ifdef _WIN32
+                    pipe_ ? _pclose(file_) : std::fclose(file_);
+#else
+                    pipe_ ? pclose(file_) : std::fclose(file_);
+#endif
+                    finished_.store(true, std::memory_order_release);
+                    return;
+                }
+                wake_.wait(seen, std::memory_order_acquire);
+                continue;
+            }
+            for (; tail != head; ++tail) {
+                if (write_frame(ring_[tail % ring_.size()].data())) {
+                    written_.fetch_add(1, std::memory_order_relaxed);
+                } else {
+                    failed_.store(true, std::memory_order_relaxed);
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                }
+                tail_.store(tail + 1, std::memory_order_release);
+            }
+        }
+    }
+
+    bool write_frame(const std::uint8_t *rgba) {
+        if (failed_.load(std::memory_order_relaxed))
+            return false;
+        if (format_ == Format::RGBA)
+            return std::fwrite(rgba, 1, frame_bytes_, file_) == frame_bytes_;
+
+        // BT.601 studio range, what Y4M readers assume by default
+        const std::size_t pixels = std::size_t(width_) * height_;
+        planes_.resize(pixels * 3);
+        std::uint8_t *y_plane = planes_.data();
+        std::uint8_t *u_plane = y_plane + pixels;
+        std::uint8_t *v_plane = u_plane + pixels;
+        for (std::size_t i = 0; i < pixels; ++i) {
+            const int r = rgba[i * 4], g = rgba[i * 4 + 1], b = rgba[i * 4 + 2];
+            y_plane[i] = static_cast<std::uint8_t>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+            u_plane[i] = static_cast<std::uint8_t>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            v_plane[i] = static_cast<std::uint8_t>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+        return std::fputs("FRAME\n", file_) >= 0 && std::fwrite(planes_.data(), 1, planes_.size(), file_) == planes_.size();
+    }
+};
+
+} // namespace pixelz
+
+#endif
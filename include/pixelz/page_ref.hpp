@@ -0,0 +1,108 @@
+// MIT License
+//
+// Copyright (c) 2022 Robert Blackwell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice (including the next
+// paragraph) shall be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF
+// OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef PIXELZ_PAGE_REF_HPP
+#define PIXELZ_PAGE_REF_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace pixelz {
+
+// Intrusively reference counted page shared between forked worlds. Released
+// pages go back to a per-type free list, so the copy made on first write to a
+// shared page reuses memory instead of allocating once the world is warm.
+template <typename Page>
+class PageRef {
+  public:
+    PageRef() = default;
+    explicit PageRef(Page *page) : page_(page) {}
+    PageRef(const PageRef &other) : page_(other.page_) {
+        if (page_)
+            page_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    PageRef(PageRef &&other) noexcept : page_(std::exchange(other.page_, nullptr)) {}
+    PageRef &operator=(PageRef other) noexcept {
+        std::swap(page_, other.page_);
+        return *this;
+    }
+    ~PageRef() { reset(); }
+
+    void reset() {
+        if (page_ && page_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            release(page_);
+        page_ = nullptr;
+    }
+
+    bool shared() const { return page_->refs.load(std::memory_order_acquire) > 1; }
+
+    Page *get() const { return page_; }
+    Page *operator->() const { return page_; }
+
+    // New page with a reference count of one. Contents are unspecified.
+    static PageRef acquire() {
+        auto &list = free_list();
+        {
+            std::lock_guard<std::mutex> lock(list.mutex);
+            if (!list.pages.empty()) {
+                Page *page = list.pages.back();
+                list.pages.pop_back();
+                page->refs.store(1, std::memory_order_relaxed);
+                return PageRef(page);
+            }
+        }
+        return PageRef(new Page());
+    }
+
+    // New page that bypasses the free list, so its memory is first written
+    // (and on NUMA systems placed) by the calling thread
+    static PageRef allocate() { return PageRef(new Page()); }
+
+  private:
+    Page *page_ = nullptr;
+
+    struct FreeList {
+        std::mutex mutex;
+        std::vector<Page *> pages;
+    };
+
+    static FreeList &free_list() {
+        // Deliberately never destroyed: pools in static worlds release their
+        // pages during static destruction, after a local static would be gone
+        static FreeList *list = new FreeList;
+        return *list;
+    }
+
+    static void release(Page *page) {
+        page->recycle();
+        auto &list = free_list();
+        std::lock_guard<std::mutex> lock(list.mutex);
+        list.pages.push_back(page);
+    }
+};
+
+} // namespace pixelz
+
+#endif
@@ -0,0 +1,365 @@
+// MIT License
+//
+// Copyright (c) 2022 Robert Blackwell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice (including the next
+// paragraph) shall be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF
+// OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef PIXELZ_PARALLEL_HPP
+#define PIXELZ_PARALLEL_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#ifdef __linux__
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Placement of the global pool's workers, see WorkerPool::Placement
+#ifndef PIXELZ_WORKER_PLACEMENT
+#define PIXELZ_WORKER_PLACEMENT None
+#endif
+
+namespace pixelz {
+
+// CPUs of each NUMA node, read from sysfs on Linux. Anywhere else, or if the
+// kernel doesn't say, every CPU is on node 0.
+struct CpuTopology {
+    static constexpr std::size_t MAX_NODES = 8; // Further nodes are folded into the last
+
+    std::vector<std::vector<unsigned>> node_cpus;
+
+    std::size_t node_count() const { return node_cpus.size(); }
+
+    static CpuTopology detect() {
+        CpuTopology topology;
+#ifdef __linux__
+        for (unsigned node = 0; node < 64; ++node) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string list;
+            if (!file || !std::getline(file, list))
+                continue;
+            auto cpus = parse_cpu_list(list);
+            if (cpus.empty())
+                continue;
+            if (topology.node_cpus.size() == MAX_NODES)
+                topology.node_cpus.back().insert(topology.node_cpus.back().end(), cpus.begin(), cpus.end());
+            else
+                topology.node_cpus.push_back(std::move(cpus));
+        }
+#endif
+        if (topology.node_cpus.empty()) {
+            topology.node_cpus.emplace_back();
+            for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+                topology.node_cpus[0].push_back(cpu);
+        }
+        return topology;
+    }
+
+    // "0-3,8-11" -> 0 1 2 3 8 9 10 11
+    static std::vector<unsigned> parse_cpu_list(const std::string &list) {
+        std::vector<unsigned> cpus;
+        std::size_t at = 0;
+        while (at < list.size()) {
+            std::size_t end = list.find(',', at);
+            if (end == std::string::npos)
+                end = list.size();
+            const std::string range = list.substr(at, end - at);
+            const std::size_t dash = range.find('-');
+            try {
+                const unsigned first = static_cast<unsigned>(std::stoul(range.substr(0, dash)));
+                const unsigned last =
+                    dash == std::string::npos ? first : static_cast<unsigned>(std::stoul(range.substr(dash + 1)));
+                for (unsigned cpu = first; cpu <= last; ++cpu)
+                    cpus.push_back(cpu);
+            } catch (...) {
+                // Trailing newline or junk, skip it
+            }
+            at = end + 1;
+        }
+        return cpus;
+    }
+};
+
+// A fixed set of worker threads that split index ranges between them. The
+// calling thread always takes part, so a pool of one thread degrades to a
+// plain loop with no synchronization cost.
+//
+// With a placement other than None, workers are pinned and each parallel_for
+// splits its blocks into one contiguous span per NUMA node, sized by the
+// node's share of the threads. Threads drain their own node's span before
+// helping elsewhere, so the same index range of the same count goes to the
+// same node every call. Memory first written from such a loop (see
+// ComponentArray::first_touch) then stays local to the node that keeps
+// processing it.
+class WorkerPool {
+  public:
+    enum class Placement {
+        None,  // Threads float, one span
+        Cores, // Each thread pinned to one core, cores filled node by node
+        Nodes, // Each thread pinned to all cores of its node
+    };
+
+    explicit WorkerPool(unsigned thread_count = std::max(1u, std::thread::hardware_concurrency()),
+                        Placement placement = Placement::None, const CpuTopology &topology = CpuTopology::detect()) {
+        // Thread 0 is the calling thread, assumed to run on the first node
+        std::vector<unsigned> cpus;
+        std::vector<unsigned> nodes;
+        for (std::size_t node = 0; node < topology.node_count(); ++node)
+            for (unsigned cpu : topology.node_cpus[node]) {
+                cpus.push_back(cpu);
+                nodes.push_back(static_cast<unsigned>(node));
+            }
+        if (placement != Placement::None) {
+            node_count_ = topology.node_count();
+            cpu_node_.assign(*std::max_element(cpus.begin(), cpus.end()) + 1, 0);
+            for (std::size_t i = 0; i < cpus.size(); ++i)
+                cpu_node_[cpus[i]] = nodes[i];
+        }
+
+        for (unsigned i = 0; i < thread_count; ++i) {
+            const unsigned node = placement == Placement::None ? 0 : nodes[i % cpus.size()];
+            ++node_threads_[node];
+            if (i == 0)
+                continue;
+            std::vector<unsigned> affinity;
+            if (placement == Placement::Cores)
+                affinity = {cpus[i % cpus.size()]};
+            else if (placement == Placement::Nodes)
+                affinity = topology.node_cpus[node];
+            workers_.emplace_back([this, node, affinity] {
+                pin_current_thread(affinity);
+                worker_loop(node);
+            });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (auto &worker : workers_)
+            worker.join();
+    }
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    unsigned thread_count() const { return static_cast<unsigned>(workers_.size()) + 1; }
+    std::size_t node_count() const { return node_count_; }
+
+    // Blocks run by a thread on another node than the span they belong to,
+    // i.e. work that likely read remote memory. Zero without a placement.
+    std::size_t remote_blocks() const { return remote_blocks_.load(std::memory_order_relaxed); }
+    std::size_t total_blocks() const { return total_blocks_.load(std::memory_order_relaxed); }
+
+    // Calls fn(begin, end) over [0, count) in blocks of at most `grain`
+    // indices. Blocks are handed out dynamically so uneven work balances.
+    template <typename F>
+    void parallel_for(std::size_t count, std::size_t grain, F &&fn) {
+        if (count == 0)
+            return;
+        grain = std::max<std::size_t>(grain, 1);
+        if (workers_.empty() || count <= grain) {
+            fn(std::size_t{0}, count);
+            return;
+        }
+
+        Job job;
+        job.count = count;
+        job.grain = grain;
+        job.span_count = node_count_;
+        split_spans(job);
+        job.context = &fn;
+        job.run = [](void *context, std::size_t begin, std::size_t end) {
+            (*static_cast<std::remove_reference_t<F> *>(context))(begin, end);
+        };
+
+        // Nested calls from inside a job, or concurrent callers, run inline
+        std::unique_lock<std::mutex> submit(submit_mutex_, std::defer_lock);
+        if (inside_job() || !submit.try_lock()) {
+            fn(std::size_t{0}, count);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_ = &job;
+            ++generation_;
+        }
+        wake_.notify_all();
+
+        run_blocks(job, caller_node());
+
+        // Wait for every worker to leave the job before it goes out of scope
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [&] { return job.active_workers == 0 && job.finished_blocks == job.block_count(); });
+        job_ = nullptr;
+    }
+
+    // Process-wide pool shared by systems and tooling. Build with
+    // -DPIXELZ_WORKER_PLACEMENT=Cores or Nodes to pin its workers.
+    static WorkerPool &global() {
+        static WorkerPool pool(std::max(1u, std::thread::hardware_concurrency()),
+                               Placement::PIXELZ_WORKER_PLACEMENT);
+        return pool;
+    }
+
+  private:
+    // Blocks [next, end) of one node's share of a job
+    struct Span {
+        std::atomic<std::size_t> next{0};
+        std::size_t end = 0;
+    };
+
+    struct Job {
+        std::size_t count = 0;
+        std::size_t grain = 1;
+        void *context = nullptr;
+        void (*run)(void *, std::size_t, std::size_t) = nullptr;
+        std::array<Span, CpuTopology::MAX_NODES> spans;
+        std::size_t span_count = 1;
+        std::atomic<std::size_t> finished_blocks{0};
+        unsigned active_workers = 0; // Guarded by mutex_
+
+        std::size_t block_count() const { return (count + grain - 1) / grain; }
+    };
+
+    std::vector<std::thread> workers_;
+    std::mutex submit_mutex_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    Job *job_ = nullptr;
+    std::size_t generation_ = 0;
+    bool stopping_ = false;
+
+    std::size_t node_count_ = 1;
+    std::array<unsigned, CpuTopology::MAX_NODES> node_threads_{};
+    std::vector<unsigned> cpu_node_; // Empty without a placement
+    std::atomic<std::size_t> remote_blocks_{0};
+    std::atomic<std::size_t> total_blocks_{0};
+
+    static void pin_current_thread(const std::vector<unsigned> &cpus) {
+#ifdef __linux__
+        if (cpus.empty())
+            return;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (unsigned cpu : cpus)
+            if (cpu < CPU_SETSIZE)
+                CPU_SET(cpu, &set);
+        // Best effort: a cpuset or container may not allow it
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+        (void)cpus;
+#endif
+    }
+
+    // Node of the (unpinned) calling thread right now
+    unsigned caller_node() const {
+#ifdef __linux__
+        if (!cpu_node_.empty()) {
+            const int cpu = sched_getcpu();
+            if (cpu >= 0 && static_cast<std::size_t>(cpu) < cpu_node_.size())
+                return cpu_node_[cpu];
+        }
+#endif
+        return 0;
+    }
+
+    // Contiguous spans of blocks, one per node, sized by its thread count
+    void split_spans(Job &job) const {
+        const std::size_t blocks = job.block_count();
+        std::size_t threads = 0;
+        for (std::size_t node = 0; node < job.span_count; ++node)
+            threads += node_threads_[node];
+        std::size_t before = 0;
+        for (std::size_t node = 0; node < job.span_count; ++node) {
+            job.spans[node].next = blocks * before / threads;
+            before += node_threads_[node];
+            job.spans[node].end = blocks * before / threads;
+        }
+    }
+
+    static bool &inside_job() {
+        static thread_local bool inside = false;
+        return inside;
+    }
+
+    void run_blocks(Job &job, unsigned node) {
+        inside_job() = true;
+        const std::size_t blocks = job.block_count();
+        std::size_t finished = 0;
+        std::size_t remote = 0;
+        // Own node's span first, then help the others in turn
+        for (std::size_t k = 0; k < job.span_count; ++k) {
+            Span &span = job.spans[(node + k) % job.span_count];
+            for (std::size_t block = span.next++; block < span.end; block = span.next++) {
+                const std::size_t begin = block * job.grain;
+                job.run(job.context, begin, std::min(begin + job.grain, job.count));
+                ++finished;
+                remote += k != 0;
+            }
+        }
+        inside_job() = false;
+        total_blocks_.fetch_add(finished, std::memory_order_relaxed);
+        if (remote)
+            remote_blocks_.fetch_add(remote, std::memory_order_relaxed);
+        if (finished && job.finished_blocks.fetch_add(finished) + finished == blocks) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_.notify_all();
+        }
+    }
+
+    void worker_loop(unsigned node) {
+        std::size_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            wake_.wait(lock, [&] { return stopping_ || (job_ && generation_ != seen); });
+            if (stopping_)
+                return;
+            seen = generation_;
+            Job &job = *job_;
+            ++job.active_workers;
+            lock.unlock();
+
+            run_blocks(job, node);
+
+            lock.lock();
+            if (--job.active_workers == 0)
+                done_.notify_all();
+        }
+    }
+};
+
+} // namespace pixelz
+
+#endif
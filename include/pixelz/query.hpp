@@ -0,0 +1,300 @@
+// MIT License
+//
+// Copyright (c) 2022 Robert Blackwell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice (including the next
+// paragraph) shall be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF
+// OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef PIXELZ_QUERY_HPP
+#define PIXELZ_QUERY_HPP
+
+#include <pixelz/reflection.hpp>
+
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PIXELZ_QUERY_SSE 1
+#endif
+
+namespace pixelz {
+
+// Text queries for inspecting a world from tooling, e.g.
+//
+//   Transform, RigidBody, !Sleeping where Transform.position.y < 0
+//
+// lists the components an entity must have, negated with '!' or "not" for
+// those it must not have, separated by commas or "and". An optional "where"
+// clause adds comparisons of a component field against a number, joined by
+// "and". A field is written Component.path, or just by its path when exactly
+// one of the listed components has it. parse_query() only checks the
+// syntax; names are resolved when a query is compiled against a world.
+enum class CompareOp : std::uint8_t { Less, LessEqual, Greater, GreaterEqual, Equal, NotEqual };
+
+struct ParsedQuery {
+    struct Comparison {
+        std::string path; // "Transform.position.y" or "position.y"
+        CompareOp op;
+        double value;
+    };
+
+    std::vector<std::string> with, without;
+    std::vector<Comparison> where;
+    std::string error; // Empty if the text parsed
+
+    bool ok() const { return error.empty(); }
+};
+
+namespace query_detail {
+
+class Lexer {
+  public:
+    explicit Lexer(std::string_view text) : text_(text) {}
+
+    std::size_t position() {
+        skip_space();
+        return at_;
+    }
+
+    bool done() { return position() == text_.size(); }
+
+    // Component names and field paths, keywords included
+    std::string_view word() {
+        skip_space();
+        const std::size_t begin = at_;
+        while (at_ < text_.size() && (std::isalnum(static_cast<unsigned char>(text_[at_])) || text_[at_] == '_' ||
+                                      (at_ > begin && text_[at_] == '.')))
+            ++at_;
+        return text_.substr(begin, at_ - begin);
+    }
+
+    bool keyword(std::string_view keyword) {
+        const std::size_t begin = position();
+        if (word() == keyword)
+            return true;
+        at_ = begin;
+        return false;
+    }
+
+    bool symbol(std::string_view symbol) {
+        if (text_.substr(position(), symbol.size()) != symbol)
+            return false;
+        at_ += symbol.size();
+        return true;
+    }
+
+    bool number(double &value) {
+        // strtod needs a terminated copy, and stops wherever the number does
+        const std::size_t begin = position();
+        const std::string rest(text_.substr(begin));
+        char *parsed = nullptr;
+        value = std::strtod(rest.c_str(), &parsed);
+        if (parsed == rest.c_str())
+            return false;
+        at_ = begin + static_cast<std::size_t>(parsed - rest.c_str());
+        return true;
+    }
+
+  private:
+    std::string_view text_;
+    std::size_t at_ = 0;
+
+    void skip_space() {
+        while (at_ < text_.size() && std::isspace(static_cast<unsigned char>(text_[at_])))
+            ++at_;
+    }
+};
+
+inline bool reserved(std::string_view word) { return word == "and" || word == "not" || word == "where"; }
+
+} // namespace query_detail
+
+inline ParsedQuery parse_query(std::string_view text) {
+    query_detail::Lexer lexer(text);
+    ParsedQuery query;
+    auto fail = [&](const char *what) {
+        query.error = std::string("expected ") + what + " at " + std::to_string(lexer.position());
+        return query;
+    };
+
+    do {
+        const bool negated = lexer.symbol("!") || lexer.keyword("not");
+        const std::string_view name = lexer.word();
+        if (name.empty() || query_detail::reserved(name) || name.find('.') != std::string_view::npos)
+            return fail("a component name");
+        (negated ? query.without : query.with).emplace_back(name);
+    } while (lexer.symbol(",") || lexer.keyword("and"));
+
+    if (lexer.keyword("where")) {
+        do {
+            ParsedQuery::Comparison comparison;
+            const std::string_view path = lexer.word();
+            if (path.empty() || query_detail::reserved(path))
+                return fail("a field");
+            comparison.path = std::string(path);
+            // Two-character operators first, so "<=" isn't read as "<"
+            if (lexer.symbol("<="))
+                comparison.op = CompareOp::LessEqual;
+            else if (lexer.symbol(">="))
+                comparison.op = CompareOp::GreaterEqual;
+            else if (lexer.symbol("==") || lexer.symbol("="))
+                comparison.op = CompareOp::Equal;
+            else if (lexer.symbol("!="))
+                comparison.op = CompareOp::NotEqual;
+            else if (lexer.symbol("<"))
+                comparison.op = CompareOp::Less;
+            else if (lexer.symbol(">"))
+                comparison.op = CompareOp::Greater;
+            else
+                return fail("a comparison");
+            if (!lexer.number(comparison.value))
+                return fail("a number");
+            query.where.push_back(std::move(comparison));
+        } while (lexer.keyword("and"));
+    }
+
+    if (!lexer.done())
+        return fail(query.where.empty() ? "',', \"and\" or \"where\"" : "\"and\"");
+    return query;
+}
+
+// Fields a comparison can read: one scalar of a known type
+inline bool comparable(const FieldInfo &field) { return field.type != FieldType::Bytes && field.count == 1; }
+
+// Read a comparable field out of `count` records `stride` bytes apart, as
+// doubles. Float32 fields are better compared as floats, see pack_column().
+inline void load_column(const FieldInfo &field, std::size_t stride, const void *records, std::size_t count,
+                        double *column) {
+    auto const *src = static_cast<const unsigned char *>(records) + field.offset;
+    auto load = [&](auto scalar) {
+        for (std::size_t i = 0; i < count; ++i) {
+            std::memcpy(&scalar, src + i * stride, sizeof(scalar));
+            column[i] = static_cast<double>(scalar);
+        }
+    };
+    switch (field.type) {
+    case FieldType::Int8: load(std::int8_t{}); break;
+    case FieldType::UInt8: load(std::uint8_t{}); break;
+    case FieldType::Int16: load(std::int16_t{}); break;
+    case FieldType::UInt16: load(std::uint16_t{}); break;
+    case FieldType::Int32: load(std::int32_t{}); break;
+    case FieldType::UInt32: load(std::uint32_t{}); break;
+    case FieldType::Int64: load(std::int64_t{}); break;
+    case FieldType::UInt64: load(std::uint64_t{}); break;
+    case FieldType::Float32: load(float{}); break;
+    case FieldType::Float64: load(double{}); break;
+    case FieldType::Bytes: break;
+    }
+}
+
+namespace query_detail {
+
+template <CompareOp Op, typename T>
+bool compare(T a, T b) {
+    if constexpr (Op == CompareOp::Less)
+        return a < b;
+    else if constexpr (Op == CompareOp::LessEqual)
+        return a <= b;
+    else if constexpr (Op == CompareOp::Greater)
+        return a > b;
+    else if constexpr (Op == CompareOp::GreaterEqual)
+        return a >= b;
+    else if constexpr (Op == CompareOp::Equal)
+        return a == b;
+    else
+        return a != b;
+}
+
+#ifdef PIXELZ_QUERY_SSE
+template <CompareOp Op>
+__m128 compare(__m128 a, __m128 b) {
+    if constexpr (Op == CompareOp::Less)
+        return _mm_cmplt_ps(a, b);
+    else if constexpr (Op == CompareOp::LessEqual)
+        return _mm_cmple_ps(a, b);
+    else if constexpr (Op == CompareOp::Greater)
+        return _mm_cmpgt_ps(a, b);
+    else if constexpr (Op == CompareOp::GreaterEqual)
+        return _mm_cmpge_ps(a, b);
+    else if constexpr (Op == CompareOp::Equal)
+        return _mm_cmpeq_ps(a, b);
+    else
+        return _mm_cmpneq_ps(a, b);
+}
+#endif
+
+template <CompareOp Op, typename T>
+void compare_column(const T *column, std::size_t count, T value, std::uint64_t *mask) {
+    std::size_t i = 0;
+#ifdef PIXELZ_QUERY_SSE
+    if constexpr (std::is_same_v<T, float>) {
+        // A 64-bit mask word from 16 four-lane compares
+        const __m128 v = _mm_set1_ps(value);
+        for (; i + 64 <= count; i += 64) {
+            std::uint64_t word = 0;
+            for (std::size_t j = 0; j < 64; j += 4)
+                word |= static_cast<std::uint64_t>(_mm_movemask_ps(compare<Op>(_mm_loadu_ps(column + i + j), v))) << j;
+            mask[i / 64] = word;
+        }
+    }
+#endif
+    for (; i < count; i += 64) {
+        std::uint64_t word = 0;
+        for (std::size_t j = 0; j < 64 && i + j < count; ++j)
+            word |= static_cast<std::uint64_t>(compare<Op>(column[i + j], value)) << j;
+        mask[i / 64] = word;
+    }
+}
+
+template <typename T>
+void compare_column(const T *column, std::size_t count, CompareOp op, T value, std::uint64_t *mask) {
+    switch (op) {
+    case CompareOp::Less: compare_column<CompareOp::Less>(column, count, value, mask); break;
+    case CompareOp::LessEqual: compare_column<CompareOp::LessEqual>(column, count, value, mask); break;
+    case CompareOp::Greater: compare_column<CompareOp::Greater>(column, count, value, mask); break;
+    case CompareOp::GreaterEqual: compare_column<CompareOp::GreaterEqual>(column, count, value, mask); break;
+    case CompareOp::Equal: compare_column<CompareOp::Equal>(column, count, value, mask); break;
+    case CompareOp::NotEqual: compare_column<CompareOp::NotEqual>(column, count, value, mask); break;
+    }
+}
+
+} // namespace query_detail
+
+// Bit i of mask[i / 64] is set where `column[i] op value`. Writes
+// (count + 63) / 64 words; bits past `count` are left clear. Float columns
+// are compared four at a time in SSE2.
+inline void compare_column(const float *column, std::size_t count, CompareOp op, float value, std::uint64_t *mask) {
+    query_detail::compare_column(column, count, op, value, mask);
+}
+
+inline void compare_column(const double *column, std::size_t count, CompareOp op, double value,
+                           std::uint64_t *mask) {
+    query_detail::compare_column(column, count, op, value, mask);
+}
+
+} // namespace pixelz
+
+#endif
@@ -0,0 +1,243 @@
+// MIT License
+//
+// Copyright (c) 2022 Robert Blackwell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice (including the next
+// paragraph) shall be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF
+// OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef PIXELZ_RANDOM_HPP
+#define PIXELZ_RANDOM_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PIXELZ_RANDOM_SSE 1
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#define PIXELZ_RANDOM_AVX2 1
+#endif
+
+// Counter-based random numbers: the n-th number of a stream is a pure
+// function of (seed, entity, stream, n), so any entity's numbers can be
+// produced on any thread, in any order, with the same result.
+//
+//   RandomStream random(seed, entity, SPAWN_STREAM);
+//   float x = random.uniform(0.0f, width);
+//
+// The distributions here are defined by this file rather than by the
+// standard library, whose distributions differ between implementations.
+namespace pixelz {
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2,
+// 3", SC '11): ten rounds of a multiply-and-xor bijection turn a 128-bit
+// counter into 128 random bits under a 64-bit key.
+class Philox {
+  public:
+    using Counter = std::array<std::uint32_t, 4>;
+    using Key = std::array<std::uint32_t, 2>;
+
+    static Counter block(Counter c, Key k) {
+        for (int round = 0; round < ROUNDS; ++round) {
+            const std::uint64_t p0 = std::uint64_t{M0} * c[0];
+            const std::uint64_t p1 = std::uint64_t{M1} * c[2];
+            c = {static_cast<std::uint32_t>(p1 >> 32) ^ c[1] ^ k[0], static_cast<std::uint32_t>(p1),
+                 static_cast<std::uint32_t>(p0 >> 32) ^ c[3] ^ k[1], static_cast<std::uint32_t>(p0)};
+            k[0] += W0;
+            k[1] += W1;
+        }
+        return c;
+    }
+
+    // out[i] = block(counters[i], key), four counters at a time in SSE2
+    // lanes, or eight in AVX2 ones when built with AVX2. `out` may be `counters`.
+    static void blocks(const Counter *counters, std::size_t count, Key key, Counter *out) {
+        std::size_t i = 0;
+#ifdef PIXELZ_RANDOM_AVX2
+        for (; i + 8 <= count; i += 8)
+            avx2_blocks(counters + i, key, out + i);
+#endif
+#ifdef PIXELZ_RANDOM_SSE
+        for (; i + 4 <= count; i += 4)
+            sse_blocks(counters + i, key, out + i);
+#endif
+        for (; i < count; ++i)
+            out[i] = block(counters[i], key);
+    }
+
+  private:
+    static constexpr int ROUNDS = 10;
+    static constexpr std::uint32_t M0 = 0xD2511F53u, M1 = 0xCD9E8D57u;
+    static constexpr std::uint32_t W0 = 0x9E3779B9u, W1 = 0xBB67AE85u;
+
+#ifdef PIXELZ_RANDOM_SSE
+    // Word w of the four counters in c[w]
+    static void sse_blocks(const Counter *counters, Key k, Counter *out) {
+        __m128i c[4];
+        for (int w = 0; w < 4; ++w)
+            c[w] = _mm_setr_epi32(static_cast<int>(counters[0][w]), static_cast<int>(counters[1][w]),
+                                  static_cast<int>(counters[2][w]), static_cast<int>(counters[3][w]));
+        const __m128i m0 = _mm_set1_epi32(static_cast<int>(M0)), m1 = _mm_set1_epi32(static_cast<int>(M1));
+        const __m128i low_words = _mm_set_epi32(0, -1, 0, -1);
+        for (int round = 0; round < ROUNDS; ++round) {
+            // Full 64-bit products split into low and high words. SSE2
+            // multiplies lanes 0 and 2 only, so lanes 1 and 3 take a second pass.
+            const __m128i even0 = _mm_mul_epu32(c[0], m0), odd0 = _mm_mul_epu32(_mm_srli_epi64(c[0], 32), m0);
+            const __m128i even1 = _mm_mul_epu32(c[2], m1), odd1 = _mm_mul_epu32(_mm_srli_epi64(c[2], 32), m1);
+            const __m128i hi0 = _mm_or_si128(_mm_srli_epi64(even0, 32), _mm_andnot_si128(low_words, odd0));
+            const __m128i hi1 = _mm_or_si128(_mm_srli_epi64(even1, 32), _mm_andnot_si128(low_words, odd1));
+            c[0] = _mm_xor_si128(_mm_xor_si128(hi1, c[1]), _mm_set1_epi32(static_cast<int>(k[0])));
+            c[1] = _mm_or_si128(_mm_and_si128(even1, low_words), _mm_slli_epi64(odd1, 32));
+            c[2] = _mm_xor_si128(_mm_xor_si128(hi0, c[3]), _mm_set1_epi32(static_cast<int>(k[1])));
+            c[3] = _mm_or_si128(_mm_and_si128(even0, low_words), _mm_slli_epi64(odd0, 32));
+            k[0] += W0;
+            k[1] += W1;
+        }
+        alignas(16) std::uint32_t words[4][4];
+        for (int w = 0; w < 4; ++w)
+            _mm_store_si128(reinterpret_cast<__m128i *>(words[w]), c[w]);
+        for (int lane = 0; lane < 4; ++lane)
+            out[lane] = {words[0][lane], words[1][lane], words[2][lane], words[3][lane]};
+    }
+#endif
+
+#ifdef PIXELZ_RANDOM_AVX2
+    // sse_blocks for eight counters
+    static void avx2_blocks(const Counter *counters, Key k, Counter *out) {
+        __m256i c[4];
+        for (int w = 0; w < 4; ++w)
+            c[w] = _mm256_setr_epi32(static_cast<int>(counters[0][w]), static_cast<int>(counters[1][w]),
+                                     static_cast<int>(counters[2][w]), static_cast<int>(counters[3][w]),
+                                     static_cast<int>(counters[4][w]), static_cast<int>(counters[5][w]),
+                                     static_cast<int>(counters[6][w]), static_cast<int>(counters[7][w]));
+        const __m256i m0 = _mm256_set1_epi32(static_cast<int>(M0)), m1 = _mm256_set1_epi32(static_cast<int>(M1));
+        const __m256i low_words = _mm256_set1_epi64x(0xFFFFFFFF);
+        for (int round = 0; round < ROUNDS; ++round) {
+            const __m256i even0 = _mm256_mul_epu32(c[0], m0), odd0 = _mm256_mul_epu32(_mm256_srli_epi64(c[0], 32), m0);
+            const __m256i even1 = _mm256_mul_epu32(c[2], m1), odd1 = _mm256_mul_epu32(_mm256_srli_epi64(c[2], 32), m1);
+            const __m256i hi0 = _mm256_or_si256(_mm256_srli_epi64(even0, 32), _mm256_andnot_si256(low_words, odd0));
+            const __m256i hi1 = _mm256_or_si256(_mm256_srli_epi64(even1, 32), _mm256_andnot_si256(low_words, odd1));
+            c[0] = _mm256_xor_si256(_mm256_xor_si256(hi1, c[1]), _mm256_set1_epi32(static_cast<int>(k[0])));
+            c[1] = _mm256_or_si256(_mm256_and_si256(even1, low_words), _mm256_slli_epi64(odd1, 32));
+            c[2] = _mm256_xor_si256(_mm256_xor_si256(hi0, c[3]), _mm256_set1_epi32(static_cast<int>(k[1])));
+            c[3] = _mm256_or_si256(_mm256_and_si256(even0, low_words), _mm256_slli_epi64(odd0, 32));
+            k[0] += W0;
+            k[1] += W1;
+        }
+        alignas(32) std::uint32_t words[4][8];
+        for (int w = 0; w < 4; ++w)
+            _mm256_store_si256(reinterpret_cast<__m256i *>(words[w]), c[w]);
+        for (int lane = 0; lane < 8; ++lane)
+            out[lane] = {words[0][lane], words[1][lane], words[2][lane], words[3][lane]};
+    }
+#endif
+};
+
+// Uniform float in [0, 1) from the top 24 bits
+inline float unit_float(std::uint32_t bits) { return static_cast<float>(bits >> 8) * (1.0f / 16777216.0f); }
+
+// The numbers of one (seed, entity, stream). Block n of the stream is
+// Philox of the counter (n, n >> 32, entity, stream) under the seed as key.
+// Also a UniformRandomBitGenerator, for code that wants one.
+class RandomStream {
+  public:
+    using result_type = std::uint32_t;
+
+    RandomStream(std::uint64_t seed, std::uint32_t entity, std::uint32_t stream, std::uint64_t block = 0)
+        : key_(key(seed)), entity_(entity), stream_(stream), block_(block) {}
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+    result_type operator()() {
+        if (used_ == 4) {
+            buffer_ = Philox::block(counter(entity_, stream_, block_++), key_);
+            used_ = 0;
+        }
+        return buffer_[used_++];
+    }
+
+    // Uniform in [0, 1)
+    float uniform() { return unit_float((*this)()); }
+
+    // Uniform in [lo, hi)
+    float uniform(float lo, float hi) { return lo + (hi - lo) * uniform(); }
+
+    // Uniform integer in [0, n), n > 0, by multiply-shift (Lemire); the bias
+    // is below n / 2^32
+    std::uint32_t below(std::uint32_t n) {
+        return static_cast<std::uint32_t>((std::uint64_t{(*this)()} * n) >> 32);
+    }
+
+    // The next `count` numbers, whole blocks generated four at a time
+    void fill(std::uint32_t *out, std::size_t count) {
+        while (count && used_ < 4) {
+            *out++ = buffer_[used_++];
+            --count;
+        }
+        constexpr std::size_t BATCH = 16;
+        Philox::Counter counters[BATCH], blocks[BATCH];
+        while (count >= 4) {
+            const std::size_t n = std::min(count / 4, BATCH);
+            for (std::size_t b = 0; b < n; ++b)
+                counters[b] = counter(entity_, stream_, block_++);
+            Philox::blocks(counters, n, key_, blocks);
+            for (std::size_t b = 0; b < n; ++b)
+                for (std::uint32_t word : blocks[b])
+                    *out++ = word;
+            count -= n * 4;
+        }
+        for (; count; --count)
+            *out++ = (*this)();
+    }
+
+    static Philox::Key key(std::uint64_t seed) {
+        return {static_cast<std::uint32_t>(seed), static_cast<std::uint32_t>(seed >> 32)};
+    }
+    static Philox::Counter counter(std::uint32_t entity, std::uint32_t stream, std::uint64_t block) {
+        return {static_cast<std::uint32_t>(block), static_cast<std::uint32_t>(block >> 32), entity, stream};
+    }
+
+  private:
+    Philox::Key key_;
+    std::uint32_t entity_;
+    std::uint32_t stream_;
+    std::uint64_t block_;
+    Philox::Counter buffer_{};
+    int used_ = 4;
+};
+
+// The first `blocks` blocks of the stream of each of `count` entities, for
+// many entities at once: out[i * blocks + b] is block b of entities[i]'s
+// stream, the numbers RandomStream(seed, entities[i], stream) starts with
+inline void stream_blocks(std::uint64_t seed, std::uint32_t stream, const std::uint32_t *entities,
+                          std::size_t count, std::size_t blocks, Philox::Counter *out) {
+    for (std::size_t i = 0; i < count; ++i)
+        for (std::size_t b = 0; b < blocks; ++b)
+            out[i * blocks + b] = RandomStream::counter(entities[i], stream, b);
+    Philox::blocks(out, count * blocks, RandomStream::key(seed), out);
+}
+
+} // namespace pixelz
+
+#endif
@@ -0,0 +1,243 @@
+// MIT License
+//
+// Copyright (c) 2022 Robert Blackwell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice (including the next
+// paragraph) shall be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF
+// OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef PIXELZ_REFLECTION_HPP
+#define PIXELZ_REFLECTION_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <typeinfo>
+#include <vector>
+
+namespace pixelz {
+
+// Scalar type of a reflected field. Anything that isn't a known scalar and
+// doesn't have its own Reflect<> specialization is treated as opaque bytes.
+enum class FieldType : std::uint8_t {
+    Bytes,
+    Int8,
+    UInt8,
+    Int16,
+    UInt16,
+    Int32,
+    UInt32,
+    Int64,
+    UInt64,
+    Float32,
+    Float64,
+};
+
+struct FieldInfo {
+    std::string name;     // Flattened path, e.g. "position.x"
+    std::uint32_t offset; // Byte offset from the start of the component
+    std::uint32_t size;   // Total size in bytes (element size * count)
+    std::uint32_t count;  // Number of scalars (arrays), 1 otherwise
+    FieldType type;
+};
+
+struct TypeInfo {
+    std::string name;
+    std::uint32_t size = 0;
+    std::uint32_t alignment = 0;
+    bool trivially_copyable = false;
+    std::vector<FieldInfo> fields;
+
+    const FieldInfo *find_field(std::string_view field_name) const {
+        for (auto const &field : fields)
+            if (field.name == field_name)
+                return &field;
+        return nullptr;
+    }
+
+    // True if every reflected field is a float, so the whole record can be
+    // handled as sizeof(T) / 4 float lanes
+    bool all_float32() const {
+        if (fields.empty())
+            return false;
+        std::uint32_t covered = 0;
+        for (auto const &field : fields) {
+            if (field.type != FieldType::Float32)
+                return false;
+            covered += field.size;
+        }
+        return covered == size;
+    }
+};
+
+template <typename T>
+struct ScalarTraits {
+    static constexpr FieldType type = FieldType::Bytes;
+};
+// clang-format off
+template <> struct ScalarTraits<std::int8_t> { static constexpr FieldType type = FieldType::Int8; };
+template <> struct ScalarTraits<std::uint8_t> { static constexpr FieldType type = FieldType::UInt8; };
+template <> struct ScalarTraits<std::int16_t> { static constexpr FieldType type = FieldType::Int16; };
+template <> struct ScalarTraits<std::uint16_t> { static constexpr FieldType type = FieldType::UInt16; };
+template <> struct ScalarTraits<std::int32_t> { static constexpr FieldType type = FieldType::Int32; };
+template <> struct ScalarTraits<std::uint32_t> { static constexpr FieldType type = FieldType::UInt32; };
+template <> struct ScalarTraits<std::int64_t> { static constexpr FieldType type = FieldType::Int64; };
+template <> struct ScalarTraits<std::uint64_t> { static constexpr FieldType type = FieldType::UInt64; };
+template <> struct ScalarTraits<float> { static constexpr FieldType type = FieldType::Float32; };
+template <> struct ScalarTraits<double> { static constexpr FieldType type = FieldType::Float64; };
+// clang-format on
+
+template <typename T>
+class TypeBuilder;
+
+// Specialize to describe a type's fields. The default reflects nothing, so
+// unspecialized components still get size/alignment/trivial-copy metadata.
+//
+//   template <> struct Reflect<Gravity> {
+//       static constexpr const char *name = "Gravity";
+//       static void describe(TypeBuilder<Gravity> &b) { b.field("force", &Gravity::force); }
+//   };
+template <typename T>
+struct Reflect {
+    static constexpr const char *name = nullptr;
+    static void describe(TypeBuilder<T> &) {}
+};
+
+template <typename T, typename = void>
+struct is_reflected : std::false_type {};
+template <typename T>
+struct is_reflected<T, std::enable_if_t<Reflect<T>::name != nullptr>> : std::true_type {};
+
+template <typename T>
+class TypeBuilder {
+  public:
+    TypeBuilder(std::vector<FieldInfo> &fields, std::string prefix, std::uint32_t base)
+        : fields_(fields), prefix_(std::move(prefix)), base_(base) {}
+
+    // Members can be declared on T or inherited from one of its bases
+    template <typename M, typename C>
+    TypeBuilder &field(const char *name, M C::*member) {
+        static_assert(std::is_base_of_v<C, T>, "member does not belong to the reflected type");
+        add<M>(prefix_ + name, base_ + member_offset(member));
+        return *this;
+    }
+
+  private:
+    std::vector<FieldInfo> &fields_;
+    std::string prefix_;
+    std::uint32_t base_;
+
+    template <typename M, typename C>
+    static std::uint32_t member_offset(M C::*member) {
+        // Address arithmetic only, nothing is read from the probe
+        alignas(T) static unsigned char probe[sizeof(T)];
+        auto *object = static_cast<C *>(reinterpret_cast<T *>(probe));
+        return static_cast<std::uint32_t>(reinterpret_cast<const unsigned char *>(&(object->*member)) - probe);
+    }
+
+    template <typename M>
+    void add(std::string name, std::uint32_t offset) {
+        if constexpr (std::is_array_v<M>) {
+            using E = std::remove_all_extents_t<M>;
+            fields_.push_back({std::move(name), offset, sizeof(M), static_cast<std::uint32_t>(sizeof(M) / sizeof(E)),
+                               ScalarTraits<E>::type});
+        } else if constexpr (is_reflected<M>::value) {
+            // Flatten nested reflected types into dotted paths
+            TypeBuilder<M> nested(fields_, name + ".", offset);
+            Reflect<M>::describe(nested);
+        } else {
+            fields_.push_back({std::move(name), offset, sizeof(M), 1, ScalarTraits<M>::type});
+        }
+    }
+};
+
+template <typename T>
+TypeInfo make_type_info() {
+    TypeInfo info;
+    info.name = is_reflected<T>::value ? Reflect<T>::name : typeid(T).name();
+    info.size = sizeof(T);
+    info.alignment = alignof(T);
+    info.trivially_copyable = std::is_trivially_copyable_v<T>;
+    TypeBuilder<T> builder(info.fields, "", 0);
+    Reflect<T>::describe(builder);
+    return info;
+}
+
+// Generic bulk helpers. These work on raw records described by a TypeInfo so
+// snapshotting, networking and export code never needs per-component code.
+
+// Gather one field out of `count` records laid out `stride` bytes apart into a
+// tightly packed column.
+inline void pack_column(const FieldInfo &field, std::size_t stride, const void *records, std::size_t count,
+                        void *column) {
+    auto const *src = static_cast<const unsigned char *>(records) + field.offset;
+    auto *dst = static_cast<unsigned char *>(column);
+    // Fixed-size memcpy lets the compiler turn the common cases into plain loads/stores
+    switch (field.size) {
+    case 4:
+        for (std::size_t i = 0; i < count; ++i)
+            std::memcpy(dst + i * 4, src + i * stride, 4);
+        break;
+    case 8:
+        for (std::size_t i = 0; i < count; ++i)
+            std::memcpy(dst + i * 8, src + i * stride, 8);
+        break;
+    default:
+        for (std::size_t i = 0; i < count; ++i)
+            std::memcpy(dst + i * field.size, src + i * stride, field.size);
+    }
+}
+
+// Scatter a packed column back into strided records
+inline void unpack_column(const FieldInfo &field, std::size_t stride, const void *column, std::size_t count,
+                          void *records) {
+    auto const *src = static_cast<const unsigned char *>(column);
+    auto *dst = static_cast<unsigned char *>(records) + field.offset;
+    switch (field.size) {
+    case 4:
+        for (std::size_t i = 0; i < count; ++i)
+            std::memcpy(dst + i * stride, src + i * 4, 4);
+        break;
+    case 8:
+        for (std::size_t i = 0; i < count; ++i)
+            std::memcpy(dst + i * stride, src + i * 8, 8);
+        break;
+    default:
+        for (std::size_t i = 0; i < count; ++i)
+            std::memcpy(dst + i * stride, src + i * field.size, field.size);
+    }
+}
+
+// Bit i is set if fields[i] differs between the two records. Only the first
+// 64 fields are tracked, which is plenty for components.
+inline std::uint64_t diff_fields(const TypeInfo &info, const void *a, const void *b) {
+    auto const *pa = static_cast<const unsigned char *>(a);
+    auto const *pb = static_cast<const unsigned char *>(b);
+    std::uint64_t mask = 0;
+    for (std::size_t i = 0; i < info.fields.size() && i < 64; ++i) {
+        auto const &field = info.fields[i];
+        if (std::memcmp(pa + field.offset, pb + field.offset, field.size) != 0)
+            mask |= std::uint64_t{1} << i;
+    }
+    return mask;
+}
+
+} // namespace pixelz
+
+#endif
@@ -0,0 +1,268 @@
+// MIT License
+//
+// Copyright (c) 2022 Robert Blackwell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice (including the next
+// paragraph) shall be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF
+// OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef PIXELZ_SNAPSHOT_CODEC_HPP
+#define PIXELZ_SNAPSHOT_CODEC_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Building blocks for compact snapshots. Floats are quantized to a fixed step,
+// optionally delta coded against a keyframe, zigzagged, split into byte planes
+// and run-length coded. Every stage is a flat loop over bytes or words so
+// decoding runs at memory speed, and each chunk is self-contained so chunks
+// can be coded on separate threads.
+namespace pixelz::codec {
+
+inline std::uint32_t zigzag(std::int32_t v) {
+    return (static_cast<std::uint32_t>(v) << 1) ^ static_cast<std::uint32_t>(v >> 31);
+}
+
+inline std::int32_t unzigzag(std::uint32_t v) {
+    return static_cast<std::int32_t>(v >> 1) ^ -static_cast<std::int32_t>(v & 1);
+}
+
+inline std::int32_t quantize(float value, float inv_step) {
+    // Clamp so runaway values (e.g. ever-accelerating particles) saturate instead of wrapping.
+    // A blown-up simulation can also produce NaN, which clamp passes through, so it becomes 0.
+    const float q = std::nearbyint(value * inv_step);
+    if (std::isnan(q))
+        return 0;
+    return static_cast<std::int32_t>(std::clamp(q, -2147483520.0f, 2147483520.0f));
+}
+
+inline void put_u32(std::vector<std::uint8_t> &out, std::uint32_t v) {
+    const std::size_t at = out.size();
+    out.resize(at + 4);
+    std::memcpy(out.data() + at, &v, 4);
+}
+
+inline bool get_u32(const std::uint8_t *&cursor, const std::uint8_t *end, std::uint32_t &v) {
+    if (end - cursor < 4)
+        return false;
+    std::memcpy(&v, cursor, 4);
+    cursor += 4;
+    return true;
+}
+
+// PackBits-style byte RLE. A control byte c < 0x80 is followed by c + 1
+// literal bytes, c >= 0x80 repeats the next byte (c & 0x7f) + 3 times.
+inline void rle_encode(const std::uint8_t *src, std::size_t size, std::vector<std::uint8_t> &out) {
+    std::size_t i = 0;
+    std::size_t literal_start = 0;
+    auto flush_literals = [&](std::size_t end) {
+        while (literal_start < end) {
+            const std::size_t n = std::min<std::size_t>(end - literal_start, 128);
+            out.push_back(static_cast<std::uint8_t>(n - 1));
+            out.insert(out.end(), src + literal_start, src + literal_start + n);
+            literal_start += n;
+        }
+    };
+
+    while (i < size) {
+        std::size_t run = 1;
+        while (i + run < size && run < 130 && src[i + run] == src[i])
+            ++run;
+        if (run >= 3) {
+            flush_literals(i);
+            out.push_back(static_cast<std::uint8_t>(0x80 | (run - 3)));
+            out.push_back(src[i]);
+            i += run;
+            literal_start = i;
+        } else {
+            i += run;
+        }
+    }
+    flush_literals(size);
+}
+
+// Returns false if the stream is malformed or doesn't fill dst exactly
+inline bool rle_decode(const std::uint8_t *src, std::size_t size, std::uint8_t *dst, std::size_t dst_size) {
+    const std::uint8_t *end = src + size;
+    std::uint8_t *out = dst;
+    std::uint8_t *out_end = dst + dst_size;
+    while (src < end) {
+        const std::uint8_t control = *src++;
+        if (control < 0x80) {
+            const std::size_t n = std::size_t{control} + 1;
+            if (static_cast<std::size_t>(end - src) < n || static_cast<std::size_t>(out_end - out) < n)
+                return false;
+            std::memcpy(out, src, n);
+            src += n;
+            out += n;
+        } else {
+            const std::size_t n = std::size_t{control & 0x7fu} + 3;
+            if (src == end || static_cast<std::size_t>(out_end - out) < n)
+                return false;
+            std::memset(out, *src++, n);
+            out += n;
+        }
+    }
+    return out == out_end;
+}
+
+// Split 32-bit words into four byte planes. Small deltas leave the upper
+// planes almost entirely zero, which is what makes the RLE effective.
+inline void shuffle4(const std::uint32_t *words, std::size_t count, std::uint8_t *planes) {
+    for (std::size_t i = 0; i < count; ++i) {
+        const std::uint32_t w = words[i];
+        planes[i] = static_cast<std::uint8_t>(w);
+        planes[count + i] = static_cast<std::uint8_t>(w >> 8);
+        planes[2 * count + i] = static_cast<std::uint8_t>(w >> 16);
+        planes[3 * count + i] = static_cast<std::uint8_t>(w >> 24);
+    }
+}
+
+inline void unshuffle4(const std::uint8_t *planes, std::size_t count, std::uint32_t *words) {
+    for (std::size_t i = 0; i < count; ++i)
+        words[i] = std::uint32_t{planes[i]} | std::uint32_t{planes[count + i]} << 8 |
+                   std::uint32_t{planes[2 * count + i]} << 16 | std::uint32_t{planes[3 * count + i]} << 24;
+}
+
+// Scratch buffers reused between calls on the same thread
+struct Scratch {
+    std::vector<std::uint32_t> words;
+    std::vector<std::uint8_t> bytes;
+};
+
+inline void encode_words(const std::uint32_t *words, std::size_t count, Scratch &scratch,
+                         std::vector<std::uint8_t> &out) {
+    scratch.bytes.resize(count * 4);
+    shuffle4(words, count, scratch.bytes.data());
+    const std::size_t length_at = out.size();
+    put_u32(out, 0);
+    rle_encode(scratch.bytes.data(), scratch.bytes.size(), out);
+    const auto length = static_cast<std::uint32_t>(out.size() - length_at - 4);
+    std::memcpy(out.data() + length_at, &length, 4);
+}
+
+inline bool decode_words(const std::uint8_t *&cursor, const std::uint8_t *end, std::size_t count, Scratch &scratch,
+                         std::uint32_t *words) {
+    std::uint32_t length;
+    if (!get_u32(cursor, end, length) || static_cast<std::size_t>(end - cursor) < length)
+        return false;
+    scratch.bytes.resize(count * 4);
+    if (!rle_decode(cursor, length, scratch.bytes.data(), scratch.bytes.size()))
+        return false;
+    cursor += length;
+    unshuffle4(scratch.bytes.data(), count, words);
+    return true;
+}
+
+// Quantize `count` floats to multiples of `precision`. If `reference` is set
+// the stored value is the difference from the reference's quantized value.
+// The quantized (non-delta) values are written to `quantized` when non-null so
+// a caller can keep them as the next reference.
+inline void encode_floats(const float *values, std::size_t count, float precision, const std::int32_t *reference,
+                          std::int32_t *quantized, Scratch &scratch, std::vector<std::uint8_t> &out) {
+    const float inv_step = 1.0f / precision;
+    scratch.words.resize(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        const std::int32_t q = quantize(values[i], inv_step);
+        if (quantized)
+            quantized[i] = q;
+        const std::int32_t delta = reference ? static_cast<std::int32_t>(static_cast<std::uint32_t>(q) -
+                                                                         static_cast<std::uint32_t>(reference[i]))
+                                             : q;
+        scratch.words[i] = zigzag(delta);
+    }
+    encode_words(scratch.words.data(), count, scratch, out);
+}
+
+inline bool decode_floats(const std::uint8_t *&cursor, const std::uint8_t *end, std::size_t count, float precision,
+                          const std::int32_t *reference, std::int32_t *quantized, Scratch &scratch, float *values) {
+    scratch.words.resize(count);
+    if (!decode_words(cursor, end, count, scratch, scratch.words.data()))
+        return false;
+    for (std::size_t i = 0; i < count; ++i) {
+        std::int32_t q = unzigzag(scratch.words[i]);
+        if (reference)
+            q = static_cast<std::int32_t>(static_cast<std::uint32_t>(q) + static_cast<std::uint32_t>(reference[i]));
+        if (quantized)
+            quantized[i] = q;
+        values[i] = static_cast<float>(q) * precision;
+    }
+    return true;
+}
+
+// Raw bytes for components that aren't plain floats. Against a reference
+// the bytes are XORed so unchanged records become zero runs.
+inline void encode_bytes(const std::uint8_t *data, std::size_t size, const std::uint8_t *reference, Scratch &scratch,
+                         std::vector<std::uint8_t> &out) {
+    const std::uint8_t *src = data;
+    if (reference) {
+        scratch.bytes.resize(size);
+        for (std::size_t i = 0; i < size; ++i)
+            scratch.bytes[i] = data[i] ^ reference[i];
+        src = scratch.bytes.data();
+    }
+    const std::size_t length_at = out.size();
+    put_u32(out, 0);
+    rle_encode(src, size, out);
+    const auto length = static_cast<std::uint32_t>(out.size() - length_at - 4);
+    std::memcpy(out.data() + length_at, &length, 4);
+}
+
+inline bool decode_bytes(const std::uint8_t *&cursor, const std::uint8_t *end, std::size_t size,
+                         const std::uint8_t *reference, std::uint8_t *data) {
+    std::uint32_t length;
+    if (!get_u32(cursor, end, length) || static_cast<std::size_t>(end - cursor) < length)
+        return false;
+    if (!rle_decode(cursor, length, data, size))
+        return false;
+    cursor += length;
+    if (reference)
+        for (std::size_t i = 0; i < size; ++i)
+            data[i] ^= reference[i];
+    return true;
+}
+
+// Ids are mostly ascending, so store successive differences
+inline void encode_ids(const std::uint32_t *ids, std::size_t count, Scratch &scratch,
+                       std::vector<std::uint8_t> &out) {
+    scratch.words.resize(count);
+    std::uint32_t previous = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        scratch.words[i] = zigzag(static_cast<std::int32_t>(ids[i] - previous));
+        previous = ids[i];
+    }
+    encode_words(scratch.words.data(), count, scratch, out);
+}
+
+inline bool decode_ids(const std::uint8_t *&cursor, const std::uint8_t *end, std::size_t count, Scratch &scratch,
+                       std::uint32_t *ids) {
+    if (!decode_words(cursor, end, count, scratch, ids))
+        return false;
+    std::uint32_t previous = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        previous += static_cast<std::uint32_t>(unzigzag(ids[i]));
+        ids[i] = previous;
+    }
+    return true;
+}
+
+} // namespace pixelz::codec
+
+#endif
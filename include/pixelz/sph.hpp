@@ -0,0 +1,294 @@
+// MIT License
+//
+// Copyright (c) 2022 Robert Blackwell
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice (including the next
+// paragraph) shall be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF
+// OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef PIXELZ_SPH_HPP
+#define PIXELZ_SPH_HPP
+
+#include <pixelz/parallel.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PIXELZ_SPH_SSE 1
+#endif
+
+namespace pixelz {
+
+// Smoothed-particle hydrodynamics for unit-mass particles in 2D (Müller et
+// al. 2003 kernels). Each step sorts the particles into a grid of cells at
+// least one smoothing radius wide, so a particle's neighbours are in its own
+// and the 8 surrounding cells. Cells are numbered row by row, which makes the
+// three cells of a neighbouring row one contiguous run of sorted particles,
+// scanned four at a time in SIMD lanes.
+//
+// Density and forces are computed in two parallel passes over the occupied
+// cells. Every particle is written by one thread only and summed in a fixed
+// order, so the result does not depend on the thread count.
+class SphFluid {
+  public:
+    struct Options {
+        float radius = 16.0f;        // Smoothing radius, in world units
+        float spacing = 8.0f;        // Distance between particles at rest density
+        float stiffness = 100000.0f; // Pressure per unit of excess density, stiffer needs shorter steps
+        float viscosity = 5.0f;      // Pulls neighbours' velocities together, also damps stiff pressure
+    };
+
+    struct Stats {
+        std::size_t cells = 0; // Occupied cells in the last step
+        float cell_size = 0.0f;
+    };
+
+    void set_options(const Options &options) { options_ = options; }
+    const Options &options() const { return options_; }
+    const Stats &stats() const { return stats_; }
+
+    // Accelerations (ax, ay) of `count` particles at (x, y) moving at (vx, vy)
+    void step(const float *x, const float *y, const float *vx, const float *vy, std::size_t count, float *ax,
+              float *ay, WorkerPool &workers) {
+        stats_ = {};
+        if (count == 0)
+            return;
+        build_grid(x, y, vx, vy, count);
+
+        const float h = options_.radius;
+        const float h2 = h * h;
+        const float rest = 1.0f / (options_.spacing * options_.spacing);
+        const float poly6 = 4.0f / (PI * std::pow(h, 8.0f));
+
+        density_.resize(count);
+        inv_density_.resize(count);
+        pressure_.resize(count);
+        workers.parallel_for(cells_.size(), GRAIN, [&](std::size_t begin, std::size_t end) {
+            for (std::size_t c = begin; c < end; ++c)
+                for_cell(cells_[c], [&](std::size_t i, const Run *runs, std::size_t run_count) {
+                    float sum = 0.0f;
+                    for (std::size_t r = 0; r < run_count; ++r)
+                        sum += density_sum(i, runs[r].first, runs[r].last, h2);
+                    density_[i] = sum * poly6;
+                    inv_density_[i] = 1.0f / density_[i];
+                    // Negative pressure would clump particles together
+                    pressure_[i] = std::max(options_.stiffness * (density_[i] - rest), 0.0f);
+                });
+        });
+
+        const float spiky = 30.0f / (PI * std::pow(h, 5.0f));
+        const float laplacian = 40.0f / (PI * std::pow(h, 5.0f)) * options_.viscosity;
+        workers.parallel_for(cells_.size(), GRAIN, [&](std::size_t begin, std::size_t end) {
+            for (std::size_t c = begin; c < end; ++c)
+                for_cell(cells_[c], [&](std::size_t i, const Run *runs, std::size_t run_count) {
+                    float fx = 0.0f, fy = 0.0f;
+                    for (std::size_t r = 0; r < run_count; ++r)
+                        force_sum(i, runs[r].first, runs[r].last, h, spiky, laplacian, fx, fy);
+                    ax[order_[i]] = fx * inv_density_[i];
+                    ay[order_[i]] = fy * inv_density_[i];
+                });
+        });
+    }
+
+    // Density of input particle i after the last step
+    float density(std::size_t i) const { return density_[slot_[i]]; }
+
+  private:
+    static constexpr float PI = 3.14159265f;
+    static constexpr std::size_t GRAIN = 64; // Occupied cells per parallel block
+
+    // Sorted particles [first, last), the cells of one neighbouring row
+    struct Run {
+        std::size_t first, last;
+    };
+
+    Options options_;
+    Stats stats_;
+
+    // Grid of the last step: cell (cx, cy) is number cy * width_ + cx and
+    // holds sorted particles [cell_start_[n], cell_start_[n + 1])
+    std::size_t width_ = 0, height_ = 0;
+    std::vector<std::uint32_t> cell_of_;
+    std::vector<std::uint32_t> cell_start_;
+    std::vector<std::uint32_t> cells_;       // Occupied cells
+    std::vector<std::uint32_t> order_, slot_; // Sorted position -> input index, and back
+
+    // Particles in cell order
+    std::vector<float> px_, py_, pvx_, pvy_;
+    std::vector<float> density_, inv_density_, pressure_;
+
+    void build_grid(const float *x, const float *y, const float *vx, const float *vy, std::size_t count) {
+        float min_x = x[0], max_x = x[0], min_y = y[0], max_y = y[0];
+        for (std::size_t i = 1; i < count; ++i) {
+            min_x = std::min(min_x, x[i]);
+            max_x = std::max(max_x, x[i]);
+            min_y = std::min(min_y, y[i]);
+            max_y = std::max(max_y, y[i]);
+        }
+
+        // Widen the cells when the particles are spread thin, so the grid
+        // stays proportional to the particle count. Wider cells still hold
+        // every neighbour, there are just more candidates to reject.
+        const std::size_t max_cells = 4 * count + 64;
+        float cell = options_.radius;
+        for (;;) {
+            width_ = static_cast<std::size_t>((max_x - min_x) / cell) + 1;
+            height_ = static_cast<std::size_t>((max_y - min_y) / cell) + 1;
+            if (width_ * height_ <= max_cells)
+                break;
+            cell *= 2.0f;
+        }
+        stats_.cell_size = cell;
+
+        // Counting sort by cell
+        cell_of_.resize(count);
+        cell_start_.assign(width_ * height_ + 1, 0);
+        for (std::size_t i = 0; i < count; ++i) {
+            const std::size_t cx = std::min(static_cast<std::size_t>((x[i] - min_x) / cell), width_ - 1);
+            const std::size_t cy = std::min(static_cast<std::size_t>((y[i] - min_y) / cell), height_ - 1);
+            cell_of_[i] = static_cast<std::uint32_t>(cy * width_ + cx);
+            ++cell_start_[cell_of_[i] + 1];
+        }
+        cells_.clear();
+        for (std::size_t n = 0; n < width_ * height_; ++n) {
+            if (cell_start_[n + 1])
+                cells_.push_back(static_cast<std::uint32_t>(n));
+            cell_start_[n + 1] += cell_start_[n];
+        }
+        stats_.cells = cells_.size();
+
+        order_.resize(count);
+        slot_.resize(count);
+        px_.resize(count);
+        py_.resize(count);
+        pvx_.resize(count);
+        pvy_.resize(count);
+        std::vector<std::uint32_t> next(cell_start_.begin(), cell_start_.end() - 1);
+        for (std::size_t i = 0; i < count; ++i) {
+            const std::uint32_t s = next[cell_of_[i]]++;
+            order_[s] = static_cast<std::uint32_t>(i);
+            slot_[i] = s;
+            px_[s] = x[i];
+            py_[s] = y[i];
+            pvx_[s] = vx[i];
+            pvy_[s] = vy[i];
+        }
+    }
+
+    // fn(i, runs, run_count) for each particle i of `cell`, with the runs
+    // holding its candidate neighbours
+    template <typename F>
+    void for_cell(std::uint32_t cell, F &&fn) const {
+        const std::size_t cx = cell % width_, cy = cell / width_;
+        const std::size_t x0 = cx > 0 ? cx - 1 : 0, x1 = std::min(cx + 1, width_ - 1);
+        const std::size_t y0 = cy > 0 ? cy - 1 : 0, y1 = std::min(cy + 1, height_ - 1);
+        Run runs[3];
+        std::size_t run_count = 0;
+        for (std::size_t row = y0; row <= y1; ++row)
+            runs[run_count++] = {cell_start_[row * width_ + x0], cell_start_[row * width_ + x1 + 1]};
+        for (std::size_t i = cell_start_[cell]; i < cell_start_[cell + 1]; ++i)
+            fn(i, runs, run_count);
+    }
+
+    // Sum of (h² - r²)³ over particles [first, last) within the radius of i
+    float density_sum(std::size_t i, std::size_t first, std::size_t last, float h2) const {
+        const float xi = px_[i], yi = py_[i];
+        float sum = 0.0f;
+        std::size_t j = first;
+#ifdef PIXELZ_SPH_SSE
+        const __m128 x4 = _mm_set1_ps(xi), y4 = _mm_set1_ps(yi), h4 = _mm_set1_ps(h2);
+        __m128 acc = _mm_setzero_ps();
+        for (; j + 4 <= last; j += 4) {
+            const __m128 dx = _mm_sub_ps(x4, _mm_loadu_ps(&px_[j]));
+            const __m128 dy = _mm_sub_ps(y4, _mm_loadu_ps(&py_[j]));
+            const __m128 t = _mm_max_ps(_mm_sub_ps(h4, _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy))),
+                                        _mm_setzero_ps());
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_mul_ps(t, t), t));
+        }
+        alignas(16) float lanes[4];
+        _mm_store_ps(lanes, acc);
+        sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+        for (; j < last; ++j) {
+            const float dx = xi - px_[j], dy = yi - py_[j];
+            const float t = std::max(h2 - (dx * dx + dy * dy), 0.0f);
+            sum += t * t * t;
+        }
+        return sum;
+    }
+
+    // Pressure and viscosity forces on i from particles [first, last)
+    void force_sum(std::size_t i, std::size_t first, std::size_t last, float h, float spiky, float laplacian,
+                   float &fx, float &fy) const {
+        constexpr float MIN_R2 = 1e-12f; // Closer than this counts as the particle itself
+        const float h2 = h * h;
+        const float xi = px_[i], yi = py_[i], vxi = pvx_[i], vyi = pvy_[i], pi = pressure_[i];
+        std::size_t j = first;
+#ifdef PIXELZ_SPH_SSE
+        const __m128 x4 = _mm_set1_ps(xi), y4 = _mm_set1_ps(yi), vx4 = _mm_set1_ps(vxi), vy4 = _mm_set1_ps(vyi);
+        const __m128 h4 = _mm_set1_ps(h), h24 = _mm_set1_ps(h2), min4 = _mm_set1_ps(MIN_R2);
+        const __m128 pi4 = _mm_set1_ps(pi), spiky4 = _mm_set1_ps(0.5f * spiky), lap4 = _mm_set1_ps(laplacian);
+        __m128 ax = _mm_setzero_ps(), ay = _mm_setzero_ps();
+        for (; j + 4 <= last; j += 4) {
+            const __m128 dx = _mm_sub_ps(x4, _mm_loadu_ps(&px_[j]));
+            const __m128 dy = _mm_sub_ps(y4, _mm_loadu_ps(&py_[j]));
+            const __m128 r2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+            const __m128 inside = _mm_and_ps(_mm_cmplt_ps(r2, h24), _mm_cmpgt_ps(r2, min4));
+            const __m128 r = _mm_sqrt_ps(_mm_max_ps(r2, min4));
+            const __m128 hr = _mm_sub_ps(h4, r);
+            const __m128 inv_rho = _mm_loadu_ps(&inv_density_[j]);
+
+            // (p_i + p_j) / (2 rho_j) * spiky * (h - r)² / r along (dx, dy); the
+            // 1 / rho_i is applied by the caller
+            const __m128 pressure = _mm_mul_ps(_mm_add_ps(pi4, _mm_loadu_ps(&pressure_[j])), inv_rho);
+            const __m128 push =
+                _mm_and_ps(_mm_div_ps(_mm_mul_ps(_mm_mul_ps(pressure, spiky4), _mm_mul_ps(hr, hr)), r), inside);
+            const __m128 drag = _mm_and_ps(_mm_mul_ps(_mm_mul_ps(lap4, hr), inv_rho), inside);
+            ax = _mm_add_ps(ax, _mm_add_ps(_mm_mul_ps(push, dx),
+                                           _mm_mul_ps(drag, _mm_sub_ps(_mm_loadu_ps(&pvx_[j]), vx4))));
+            ay = _mm_add_ps(ay, _mm_add_ps(_mm_mul_ps(push, dy),
+                                           _mm_mul_ps(drag, _mm_sub_ps(_mm_loadu_ps(&pvy_[j]), vy4))));
+        }
+        alignas(16) float lanes_x[4], lanes_y[4];
+        _mm_store_ps(lanes_x, ax);
+        _mm_store_ps(lanes_y, ay);
+        fx += (lanes_x[0] + lanes_x[1]) + (lanes_x[2] + lanes_x[3]);
+        fy += (lanes_y[0] + lanes_y[1]) + (lanes_y[2] + lanes_y[3]);
+#endif
+        for (; j < last; ++j) {
+            const float dx = xi - px_[j], dy = yi - py_[j];
+            const float r2 = dx * dx + dy * dy;
+            if (r2 >= h2 || r2 <= MIN_R2)
+                continue;
+            const float r = std::sqrt(r2);
+            const float hr = h - r;
+            const float push = (pi + pressure_[j]) * inv_density_[j] * 0.5f * spiky * hr * hr / r;
+            const float drag = laplacian * hr * inv_density_[j];
+            fx += push * dx + drag * (pvx_[j] - vxi);
+            fy += push * dy + drag * (pvy_[j] - vyi);
+        }
+    }
+};
+
+} // namespace pixelz
+
+#endif
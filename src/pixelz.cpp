@@ -23,24 +23,71 @@
 // OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include <raylib-cpp.hpp>
+#include <rlgl.h>
+
+// Capture reads the framebuffer straight into a buffer of its own. raylib's
+// readbacks allocate a frame-sized image per call, and including the GL
+// headers clashes with raylib's names on Windows, so declare the one GL 1.0
+// call needed; every desktop GL library raylib links exports it.
+#ifdef _WIN32
+#define PIXELZ_GLAPI __stdcall
+#else
+#define PIXELZ_GLAPI
+#endif
+extern "C" void PIXELZ_GLAPI glReadPixels(int x, int y, int width, int height, unsigned int format, unsigned int type,
+                                          void *pixels);
+constexpr unsigned int PIXELZ_GL_RGBA = 0x1908;
+constexpr unsigned int PIXELZ_GL_UNSIGNED_BYTE = 0x1401;
+
+#include <pixelz/barnes_hut.hpp>
+#include <pixelz/behavior.hpp>
+#include <pixelz/bitmap_index.hpp>
+#include <pixelz/bvh.hpp>
+#include <pixelz/contact_solver.hpp>
+#include <pixelz/frame_capture.hpp>
+#include <pixelz/page_ref.hpp>
+#include <pixelz/parallel.hpp>
+#include <pixelz/query.hpp>
+#include <pixelz/random.hpp>
+#include <pixelz/reflection.hpp>
+#include <pixelz/snapshot_codec.hpp>
+#include <pixelz/sph.hpp>
 
 #include <array>
+#include <atomic>
 #include <bitset>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <initializer_list>
+#include <future>
 #include <iostream>
+#include <iterator>
 #include <memory>
-#include <queue>
-#include <random>
+#include <mutex>
 #include <set>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace pixelz {
 raylib::Window window(1920, 1080, "pixelz");
 
 using Entity = std::uint32_t;
-constexpr Entity MAX_ENTITIES = 5000;
+// Override with -DPIXELZ_MAX_ENTITIES=... for large worlds
+#ifndef PIXELZ_MAX_ENTITIES
+#define PIXELZ_MAX_ENTITIES 5000
+#endif
+constexpr Entity MAX_ENTITIES = PIXELZ_MAX_ENTITIES;
 
 using ComponentType = std::uint8_t;
 constexpr ComponentType MAX_COMPONENTS = 32;
+// Returned by the runtime registration and lookup methods when they fail
+constexpr ComponentType INVALID_COMPONENT = MAX_COMPONENTS;
 
 using Signature = std::bitset<MAX_COMPONENTS>;
 
@@ -59,8 +106,79 @@ struct RigidBody {
     raylib::Vector2 acceleration;
 };
 
+// Immovable box that rigid bodies collide with, `size` wide and tall,
+// hanging down and to the right of the entity's Transform position
+struct StaticCollider {
+    raylib::Vector2 size{0.0, 0.0};
+};
+
+// Marks a rigid body as a fluid particle, see FluidSystem
+struct Fluid {};
+
+// Makes a rigid body attract and be attracted by the others that have a
+// Mass, see GravitationSystem
+struct Mass {
+    float value = 1.0f;
+};
+
+} // namespace pixelz
+
+// Reflection metadata for the plain-data components. Serialization, diffing and
+// export code walks these descriptions instead of knowing about each type.
+template <>
+struct pixelz::Reflect<raylib::Vector2> {
+    static constexpr const char *name = "Vector2";
+    static void describe(TypeBuilder<raylib::Vector2> &b) { b.field("x", &::Vector2::x).field("y", &::Vector2::y); }
+};
+
+template <>
+struct pixelz::Reflect<pixelz::Transform> {
+    static constexpr const char *name = "Transform";
+    static void describe(TypeBuilder<Transform> &b) {
+        b.field("position", &Transform::position).field("rotation", &Transform::rotation).field("scale", &Transform::scale);
+    }
+};
+
+template <>
+struct pixelz::Reflect<pixelz::Gravity> {
+    static constexpr const char *name = "Gravity";
+    static void describe(TypeBuilder<Gravity> &b) { b.field("force", &Gravity::force); }
+};
+
+template <>
+struct pixelz::Reflect<pixelz::StaticCollider> {
+    static constexpr const char *name = "StaticCollider";
+    static void describe(TypeBuilder<StaticCollider> &b) { b.field("size", &StaticCollider::size); }
+};
+
+template <>
+struct pixelz::Reflect<pixelz::Fluid> {
+    static constexpr const char *name = "Fluid";
+    static void describe(TypeBuilder<Fluid> &) {}
+};
+
+template <>
+struct pixelz::Reflect<pixelz::Mass> {
+    static constexpr const char *name = "Mass";
+    static void describe(TypeBuilder<Mass> &b) { b.field("value", &Mass::value); }
+};
+
+template <>
+struct pixelz::Reflect<pixelz::RigidBody> {
+    static constexpr const char *name = "RigidBody";
+    static void describe(TypeBuilder<RigidBody> &b) {
+        b.field("velocity", &RigidBody::velocity).field("acceleration", &RigidBody::acceleration);
+    }
+};
+
+namespace pixelz {
 struct Renderable {
     virtual void Draw(const Transform &transform){};
+    // Screen area Draw() covers, used to find what a cached layer must redraw
+    virtual ::Rectangle Bounds(const Transform &transform) const {
+        return {transform.position.x, (float)window.GetHeight() - transform.position.y, transform.scale,
+                transform.scale};
+    }
 };
 
 struct Rectangle : public Renderable {
@@ -78,344 +196,3166 @@ struct Rectangle : public Renderable {
     Rectangle() = default;
 };
 
+// Components per pool page. Pages are the unit of copy-on-write sharing
+// between forked worlds and the unit of work for chunked bulk operations.
+constexpr size_t POOL_PAGE_SIZE = 1024;
+
+constexpr std::uint32_t INVALID_INDEX = UINT32_MAX;
+
+// Owner of a tombstoned slot in a stable pool
+constexpr Entity INVALID_ENTITY = UINT32_MAX;
+
+// Hands out entity IDs in the same order a queue prefilled with every ID
+// would: never-used IDs first, in order, then destroyed ones, oldest first.
+// Nothing is allocated up front. Signatures live in pages that grow with the
+// highest ID handed out, and destroyed IDs are queued through links in the
+// same pages, so a copy shares every page copy-on-write and costs O(pages)
+// however many entities there are. At most MAX_ENTITIES entities may be
+// alive at once.
 class EntityManager {
   public:
-    EntityManager() {
-        for (Entity entity = 0; entity < MAX_ENTITIES; ++entity)
-            available_entities_.push(entity);
-    }
-
     Entity create_entity() {
-        Entity id = available_entities_.front();
-        available_entities_.pop();
+        Entity id;
+        if (next_entity_ < MAX_ENTITIES) {
+            id = next_entity_++;
+            if (id % POOL_PAGE_SIZE == 0)
+                pages_.push_back(PageRef<Page>::acquire());
+        } else {
+            id = free_head_;
+            free_head_ = pages_[id / POOL_PAGE_SIZE]->next_free[id % POOL_PAGE_SIZE];
+            --free_count_;
+        }
+        writable(id).signatures[id % POOL_PAGE_SIZE].reset();
         ++living_entity_count_;
 
         return id;
     }
 
     void destroy_entity(Entity entity) {
-        signatures_[entity].reset();
-        available_entities_.push(entity);
+        writable(entity).signatures[entity % POOL_PAGE_SIZE].reset();
+        if (free_count_++ == 0)
+            free_head_ = entity;
+        else
+            writable(free_tail_).next_free[free_tail_ % POOL_PAGE_SIZE] = entity;
+        free_tail_ = entity;
         --living_entity_count_;
     }
 
-    void set_signature(Entity entity, Signature signature) { signatures_[entity] = signature; }
+    void set_signature(Entity entity, Signature signature) {
+        writable(entity).signatures[entity % POOL_PAGE_SIZE] = signature;
+    }
+
+    Signature get_signature(Entity entity) const {
+        return entity < next_entity_ ? pages_[entity / POOL_PAGE_SIZE]->signatures[entity % POOL_PAGE_SIZE]
+                                     : Signature{};
+    }
 
-    Signature get_signature(Entity entity) { return signatures_[entity]; }
+    // One past the highest ID ever handed out
+    Entity id_bound() const { return next_entity_; }
 
   private:
-    std::queue<Entity> available_entities_{};
-    std::array<Signature, MAX_ENTITIES> signatures_{};
+    struct Page {
+        std::atomic<std::uint32_t> refs{1};
+        std::array<Signature, POOL_PAGE_SIZE> signatures;
+        std::array<Entity, POOL_PAGE_SIZE> next_free; // Next destroyed ID in the queue, for queued IDs
+
+        void recycle() {}
+    };
+
+    std::vector<PageRef<Page>> pages_;
+    Entity next_entity_{};
+    // Destroyed IDs, reused once the fresh ones run out
+    Entity free_head_{}, free_tail_{};
+    size_t free_count_{};
     std::uint32_t living_entity_count_{};
+
+    Page &writable(Entity entity) {
+        PageRef<Page> &ref = pages_[entity / POOL_PAGE_SIZE];
+        if (ref.shared()) {
+            auto copy = PageRef<Page>::acquire();
+            copy->signatures = ref->signatures;
+            copy->next_free = ref->next_free;
+            ref = std::move(copy);
+        }
+        return *ref.get();
+    }
+};
+
+// How a component type is stored. Specialize ComponentStorage to choose:
+//
+//   template <> struct ComponentStorage<Joint> { static constexpr Storage value = Storage::Stable; };
+//
+// Dense:  packed pages with swap-and-pop removal, the fastest to iterate.
+// Stable: removal leaves a tombstone that a later insert reuses, so a
+//         component never moves while its entity keeps it, until the pool
+//         is explicitly compacted.
+// Sparse: packed pages, but entities are looked up through a small hash
+//         table instead of index pages spanning the whole id range. For
+//         components only a few, scattered entities have.
+// Tag:    membership only, no per-entity data. The default for empty types.
+enum class Storage : std::uint8_t { Dense, Stable, Sparse, Tag };
+
+template <typename T>
+struct ComponentStorage {
+    static constexpr Storage value = std::is_empty_v<T> ? Storage::Tag : Storage::Dense;
+};
+
+inline size_t pool_page_count(size_t size) { return (size + POOL_PAGE_SIZE - 1) / POOL_PAGE_SIZE; }
+
+// Map from an entity ID to a packed index, in pages shared copy-on-write
+// between forked pools like the component pages themselves. A hashed index
+// keeps an open-addressing table instead, whose size follows the number of
+// entries rather than the largest entity ID.
+class EntityIndex {
+  public:
+    void set_hashed(bool hashed) { hashed_ = hashed; }
+
+    size_t index_of(Entity entity) const {
+        if (hashed_)
+            return find(entity);
+        size_t page = entity / POOL_PAGE_SIZE;
+        if (page >= pages_.size())
+            return INVALID_INDEX;
+        return pages_[page]->index[entity % POOL_PAGE_SIZE];
+    }
+
+    // One bit per entity that has an entry, for bitmap queries
+    const HierarchicalBitset &members() const { return members_; }
+
+    // Start loading the entry of an entity that will be looked up soon
+    void prefetch(Entity entity) const {
+        if (hashed_) {
+            if (!table_.empty())
+                __builtin_prefetch(&table_[home(entity)]);
+            return;
+        }
+        size_t page = entity / POOL_PAGE_SIZE;
+        if (page < pages_.size())
+            __builtin_prefetch(&pages_[page]->index[entity % POOL_PAGE_SIZE]);
+    }
+
+    void set_index(Entity entity, size_t index) {
+        if (index == INVALID_INDEX)
+            members_.reset(entity);
+        else
+            members_.set(entity);
+        if (hashed_) {
+            if (index == INVALID_INDEX)
+                erase(entity);
+            else
+                insert(entity, static_cast<std::uint32_t>(index));
+            return;
+        }
+        size_t page = entity / POOL_PAGE_SIZE;
+        while (pages_.size() <= page) {
+            auto fresh = PageRef<Page>::acquire();
+            fresh->index.fill(INVALID_INDEX);
+            pages_.push_back(std::move(fresh));
+        }
+        writable(pages_[page]).index[entity % POOL_PAGE_SIZE] = static_cast<std::uint32_t>(index);
+    }
+
+  private:
+    struct Page {
+        std::atomic<std::uint32_t> refs{1};
+        std::array<std::uint32_t, POOL_PAGE_SIZE> index;
+
+        void recycle() {}
+    };
+
+    struct Slot {
+        Entity entity;
+        std::uint32_t index;
+    };
+
+    std::vector<PageRef<Page>> pages_;
+    HierarchicalBitset members_;
+
+    bool hashed_ = false;
+    std::vector<Slot> table_; // Linear probing, power-of-two size, empty slots hold INVALID_ENTITY
+    size_t hashed_count_ = 0;
+
+    static Page &writable(PageRef<Page> &ref) {
+        if (ref.shared()) {
+            auto copy = PageRef<Page>::acquire();
+            copy->index = ref->index;
+            ref = std::move(copy);
+        }
+        return *ref.get();
+    }
+
+    size_t home(Entity entity) const {
+        // Fibonacci hashing, so ids with equal low bits still spread out
+        return static_cast<size_t>((entity * 0x9E3779B97F4A7C15ull) >> 32) & (table_.size() - 1);
+    }
+
+    size_t find(Entity entity) const {
+        if (table_.empty() || entity == INVALID_ENTITY)
+            return INVALID_INDEX;
+        for (size_t slot = home(entity);; slot = (slot + 1) & (table_.size() - 1)) {
+            if (table_[slot].entity == entity)
+                return table_[slot].index;
+            if (table_[slot].entity == INVALID_ENTITY)
+                return INVALID_INDEX;
+        }
+    }
+
+    void insert(Entity entity, std::uint32_t index) {
+        // Keep the load factor at or below one half
+        if ((hashed_count_ + 1) * 2 > table_.size())
+            grow();
+        size_t slot = home(entity);
+        while (table_[slot].entity != INVALID_ENTITY && table_[slot].entity != entity)
+            slot = (slot + 1) & (table_.size() - 1);
+        if (table_[slot].entity == INVALID_ENTITY)
+            ++hashed_count_;
+        table_[slot] = {entity, index};
+    }
+
+    void erase(Entity entity) {
+        if (table_.empty())
+            return;
+        const size_t mask = table_.size() - 1;
+        size_t slot = home(entity);
+        while (table_[slot].entity != entity) {
+            if (table_[slot].entity == INVALID_ENTITY)
+                return;
+            slot = (slot + 1) & mask;
+        }
+        // Shift later entries of the probe run back so lookups needn't skip holes
+        for (size_t next = (slot + 1) & mask; table_[next].entity != INVALID_ENTITY; next = (next + 1) & mask) {
+            const size_t want = home(table_[next].entity);
+            if (((next - want) & mask) >= ((next - slot) & mask)) {
+                table_[slot] = table_[next];
+                slot = next;
+            }
+        }
+        table_[slot].entity = INVALID_ENTITY;
+        --hashed_count_;
+    }
+
+    void grow() {
+        std::vector<Slot> old = std::move(table_);
+        table_.assign(std::max<size_t>(16, old.size() * 2), {INVALID_ENTITY, INVALID_INDEX});
+        hashed_count_ = 0;
+        for (auto const &slot : old)
+            if (slot.entity != INVALID_ENTITY)
+                insert(slot.entity, slot.index);
+    }
 };
 
 // The one instance of virtual inheritance in the entire implementation.
 // An interface is needed so that the ComponentManager (seen later)
 // can tell a generic ComponentArray that an entity has been destroyed
 // and that it needs to update its array mappings.
+//
+// The raw accessors are the only other virtual calls, and they are made once
+// per page rather than once per element, so generic code (snapshots, export)
+// can memcpy whole pages using the component's TypeInfo. The entity index
+// lives in the base, so membership tests never go through a virtual call.
 class IComponentArray {
   public:
     virtual ~IComponentArray() = default;
+
+    bool has_data(Entity entity) const { return index_.index_of(entity) != INVALID_INDEX; }
+    // Packed index of the entity's component, INVALID_INDEX if it has none
+    size_t index_of(Entity entity) const { return index_.index_of(entity); }
+    // Entities having the component, as a bitset over entity IDs
+    const HierarchicalBitset &members() const { return index_.members(); }
+
     virtual void entity_destroyed(Entity entity) = 0;
+
+    // Number of packed components. Packed index i lives in page
+    // i / POOL_PAGE_SIZE, and every page but the last is full.
+    virtual size_t size() const = 0;
+    // Packed components of a page, TypeInfo::size bytes each. The mutable
+    // overload gives the pool its own copy of the page first if it is shared.
+    virtual const void *page_data(size_t page) const = 0;
+    virtual void *page_data(size_t page) = 0;
+    // Owners of the packed components of a page
+    virtual const Entity *page_entities(size_t page) const = 0;
+    // Overwrite the components of entities that already have one with raw
+    // records. Only trivially copyable components support this. Returns the
+    // number of records written.
+    virtual size_t assign_raw(const Entity *entities, const void *records, size_t count) = 0;
+    // Copy of this pool that shares every page copy-on-write
+    virtual std::shared_ptr<IComponentArray> fork() const = 0;
+    // Make this pool share every page of `other`, a pool of the same type.
+    // Reuses this pool's page tables, so it doesn't allocate once warm.
+    virtual void assign_from(const IComponentArray &other) = 0;
+    // Replace every page with a fresh copy written from the worker that a
+    // parallel loop over this pool hands the page to, so with a pinned
+    // WorkerPool each page lives on the node that processes it. Pages added
+    // later land wherever they are first written, so run it after bulk spawns.
+    virtual void first_touch(WorkerPool &workers) = 0;
+
+  protected:
+    EntityIndex index_;
 };
 
 template <typename T>
 class ComponentArray : public IComponentArray {
+    struct DensePage;
+
   public:
+    static constexpr Storage STORAGE = ComponentStorage<T>::value;
+
+    ComponentArray() { index_.set_hashed(STORAGE == Storage::Sparse); }
+
     void insert_data(Entity entity, T component) {
-        // Put new entry at end and update the maps
+        // Stable pools fill the most recent hole first
         size_t new_index = size_;
-        entity_to_index_map_[entity] = new_index;
-        index_to_entity_map_[new_index] = entity;
-        component_array_[new_index] = component;
-        ++size_;
+        if (STORAGE == Storage::Stable && !free_slots_.empty()) {
+            new_index = free_slots_.back();
+            free_slots_.pop_back();
+        } else {
+            // Put new entry at end and update the maps
+            if (new_index % POOL_PAGE_SIZE == 0)
+                dense_pages_.push_back(DensePageRef::acquire());
+            ++size_;
+        }
+        auto &page = writable(dense_pages_[new_index / POOL_PAGE_SIZE]);
+        if constexpr (STORAGE != Storage::Tag)
+            page.data[new_index % POOL_PAGE_SIZE] = component;
+        page.entities[new_index % POOL_PAGE_SIZE] = entity;
+        index_.set_index(entity, new_index);
+        ++live_;
     }
 
     void remove_data(Entity entity) {
+        if constexpr (STORAGE == Storage::Stable) {
+            // Leave a tombstone so no other component moves
+            size_t index = index_of(entity);
+            auto &page = writable(dense_pages_[index / POOL_PAGE_SIZE]);
+            page.data[index % POOL_PAGE_SIZE] = T{};
+            page.entities[index % POOL_PAGE_SIZE] = INVALID_ENTITY;
+            index_.set_index(entity, INVALID_INDEX);
+            free_slots_.push_back(static_cast<std::uint32_t>(index));
+            --live_;
+            return;
+        }
+
         // Copy element at end into deleted element's place to maintain density
-        size_t indexOfRemovedEntity = entity_to_index_map_[entity];
+        size_t indexOfRemovedEntity = index_of(entity);
         size_t indexOfLastElement = size_ - 1;
-        component_array_[indexOfRemovedEntity] = component_array_[indexOfLastElement];
+        const DensePage &last_page = *dense_pages_[indexOfLastElement / POOL_PAGE_SIZE].get();
+        Entity entityOfLastElement = last_page.entities[indexOfLastElement % POOL_PAGE_SIZE];
+        if (indexOfRemovedEntity != indexOfLastElement) {
+            auto &removed_page = writable(dense_pages_[indexOfRemovedEntity / POOL_PAGE_SIZE]);
+            if constexpr (STORAGE != Storage::Tag)
+                removed_page.data[indexOfRemovedEntity % POOL_PAGE_SIZE] = last_page.data[indexOfLastElement % POOL_PAGE_SIZE];
+            removed_page.entities[indexOfRemovedEntity % POOL_PAGE_SIZE] = entityOfLastElement;
+        }
 
         // Update map to point to moved spot
-        Entity entityOfLastElement = index_to_entity_map_[indexOfLastElement];
-        entity_to_index_map_[entityOfLastElement] = indexOfRemovedEntity;
-        index_to_entity_map_[indexOfRemovedEntity] = entityOfLastElement;
+        index_.set_index(entityOfLastElement, indexOfRemovedEntity);
+        index_.set_index(entity, INVALID_INDEX);
+
+        --size_;
+        --live_;
+        if (size_ % POOL_PAGE_SIZE == 0)
+            dense_pages_.pop_back();
+    }
+
+    T &get_data(Entity entity) {
+        // Return a reference to the entity's component
+        return get_at(index_of(entity));
+    }
+
+    // Read-only access never copies a shared page
+    const T &read_data(Entity entity) const { return read_at(index_of(entity)); }
+
+    // Access by packed index
+    T &get_at(size_t index) {
+        if constexpr (STORAGE == Storage::Tag)
+            return tag();
+        else
+            return writable(dense_pages_[index / POOL_PAGE_SIZE]).data[index % POOL_PAGE_SIZE];
+    }
+
+    const T &read_at(size_t index) const {
+        if constexpr (STORAGE == Storage::Tag)
+            return tag();
+        else
+            return dense_pages_[index / POOL_PAGE_SIZE]->data[index % POOL_PAGE_SIZE];
+    }
+
+    // Components actually held; size() also counts a stable pool's tombstones
+    size_t live_count() const { return live_; }
+
+    // Reference to one entity's component that skips the entity index while
+    // the component stays where it was. If it was moved (compaction, or
+    // swap-and-pop in a dense pool) get() looks the entity up once and
+    // refreshes the handle.
+    struct Handle {
+        Entity entity = INVALID_ENTITY;
+        std::uint32_t index = INVALID_INDEX;
+    };
+
+    Handle handle(Entity entity) const { return {entity, static_cast<std::uint32_t>(index_of(entity))}; }
+
+    // nullptr once the entity no longer has the component
+    T *get(Handle &handle) {
+        return refresh(handle) ? &get_at(handle.index) : nullptr;
+    }
+
+    const T *read(Handle &handle) const {
+        return refresh(handle) ? &read_at(handle.index) : nullptr;
+    }
+
+    // Move up to `budget` components of a stable pool from its end into its
+    // lowest tombstones, and drop the tombstones left at the end along with
+    // any page they emptied. Raw pointers to moved components are invalid
+    // afterwards; handles refresh themselves. Returns the number moved, so a
+    // caller can spread a large compaction over several frames.
+    size_t compact(size_t budget) {
+        if constexpr (STORAGE != Storage::Stable) {
+            return 0;
+        } else {
+            std::sort(free_slots_.begin(), free_slots_.end());
+            size_t moved = 0;
+            size_t next_hole = 0;
+            for (;;) {
+                // Tombstones at the end are always the largest free slots
+                while (size_ && dense_pages_[(size_ - 1) / POOL_PAGE_SIZE]->entities[(size_ - 1) % POOL_PAGE_SIZE] ==
+                                    INVALID_ENTITY) {
+                    free_slots_.pop_back();
+                    shrink();
+                }
+                if (moved == budget || next_hole >= free_slots_.size())
+                    break;
+
+                const size_t hole = free_slots_[next_hole++];
+                const size_t last = size_ - 1;
+                auto &from = writable(dense_pages_[last / POOL_PAGE_SIZE]);
+                auto &to = writable(dense_pages_[hole / POOL_PAGE_SIZE]);
+                const Entity entity = from.entities[last % POOL_PAGE_SIZE];
+                to.data[hole % POOL_PAGE_SIZE] = std::move(from.data[last % POOL_PAGE_SIZE]);
+                to.entities[hole % POOL_PAGE_SIZE] = entity;
+                from.data[last % POOL_PAGE_SIZE] = T{};
+                index_.set_index(entity, hole);
+                shrink();
+                ++moved;
+            }
+            // Whatever holes remain are filled lowest first from now on
+            free_slots_.erase(free_slots_.begin(), free_slots_.begin() + std::min(next_hole, free_slots_.size()));
+            std::reverse(free_slots_.begin(), free_slots_.end());
+            return moved;
+        }
+    }
+
+    // Prefetch hints for loops that will look up entities out of order, e.g.
+    // joins and entity references. Issue prefetch_index() a few iterations
+    // before prefetch_data(), which reads the index to find the component.
+    void prefetch_index(Entity entity) const { index_.prefetch(entity); }
+
+    void prefetch_data(Entity entity) const {
+        if constexpr (STORAGE != Storage::Tag) {
+            size_t index = index_of(entity);
+            if (index != INVALID_INDEX)
+                __builtin_prefetch(&dense_pages_[index / POOL_PAGE_SIZE]->data[index % POOL_PAGE_SIZE]);
+        }
+    }
+
+    // Random-access iteration over the packed components, usable with the
+    // std::execution parallel algorithms. it.entity() gives the owner, or
+    // INVALID_ENTITY for a tombstone in a stable pool.
+    template <bool Const>
+    class Iterator {
+      public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::conditional_t<Const, const T *, T *>;
+        using reference = std::conditional_t<Const, const T &, T &>;
+
+        Iterator() = default;
+        Iterator(const PageRef<DensePage> *pages, size_t index) : pages_(pages), index_(index) {}
+
+        reference operator*() const {
+            if constexpr (STORAGE == Storage::Tag)
+                return tag();
+            else
+                return pages_[index_ / POOL_PAGE_SIZE]->data[index_ % POOL_PAGE_SIZE];
+        }
+        pointer operator->() const { return &**this; }
+        reference operator[](difference_type n) const { return *(*this + n); }
+        Entity entity() const { return pages_[index_ / POOL_PAGE_SIZE]->entities[index_ % POOL_PAGE_SIZE]; }
+
+        Iterator &operator++() { return ++index_, *this; }
+        Iterator operator++(int) { return Iterator(pages_, index_++); }
+        Iterator &operator--() { return --index_, *this; }
+        Iterator operator--(int) { return Iterator(pages_, index_--); }
+        Iterator &operator+=(difference_type n) { return index_ += n, *this; }
+        Iterator &operator-=(difference_type n) { return index_ -= n, *this; }
+        friend Iterator operator+(Iterator it, difference_type n) { return it += n; }
+        friend Iterator operator+(difference_type n, Iterator it) { return it += n; }
+        friend Iterator operator-(Iterator it, difference_type n) { return it -= n; }
+        friend difference_type operator-(const Iterator &a, const Iterator &b) {
+            return static_cast<difference_type>(a.index_) - static_cast<difference_type>(b.index_);
+        }
+        friend bool operator==(const Iterator &a, const Iterator &b) { return a.index_ == b.index_; }
+        friend bool operator!=(const Iterator &a, const Iterator &b) { return a.index_ != b.index_; }
+        friend bool operator<(const Iterator &a, const Iterator &b) { return a.index_ < b.index_; }
+        friend bool operator>(const Iterator &a, const Iterator &b) { return a.index_ > b.index_; }
+        friend bool operator<=(const Iterator &a, const Iterator &b) { return a.index_ <= b.index_; }
+        friend bool operator>=(const Iterator &a, const Iterator &b) { return a.index_ >= b.index_; }
+
+      private:
+        const PageRef<DensePage> *pages_ = nullptr;
+        size_t index_ = 0;
+    };
 
-        entity_to_index_map_.erase(entity);
-        index_to_entity_map_.erase(indexOfLastElement);
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+
+    // The mutable range unshares every page up front, so elements can then be
+    // written concurrently from any number of threads without locking
+    iterator begin() {
+        make_writable();
+        return iterator(dense_pages_.data(), 0);
+    }
+    iterator end() { return iterator(dense_pages_.data(), size_); }
+    const_iterator begin() const { return const_iterator(dense_pages_.data(), 0); }
+    const_iterator end() const { return const_iterator(dense_pages_.data(), size_); }
+
+    // Give this pool its own copy of every page shared with a forked world
+    void make_writable() {
+        for (auto &page : dense_pages_)
+            writable(page);
+    }
+
+    void entity_destroyed(Entity entity) override {
+        if (has_data(entity)) {
+            // Remove the entity's component if it existed
+            remove_data(entity);
+        }
+    }
+
+    size_t size() const override { return size_; }
+    const void *page_data(size_t page) const override {
+        if constexpr (STORAGE == Storage::Tag)
+            return tag_page();
+        else
+            return dense_pages_[page]->data.data();
+    }
+    void *page_data(size_t page) override {
+        if constexpr (STORAGE == Storage::Tag)
+            return tag_page();
+        else
+            return writable(dense_pages_[page]).data.data();
+    }
+    const Entity *page_entities(size_t page) const override { return dense_pages_[page]->entities.data(); }
+
+    size_t assign_raw(const Entity *entities, const void *records, size_t count) override {
+        if constexpr (!std::is_trivially_copyable_v<T>) {
+            return 0;
+        } else {
+            size_t written = 0;
+            auto const *src = static_cast<const unsigned char *>(records);
+            for (size_t i = 0; i < count; ++i) {
+                if (!has_data(entities[i]))
+                    continue;
+                if constexpr (STORAGE != Storage::Tag)
+                    std::memcpy(&get_data(entities[i]), src + i * sizeof(T), sizeof(T));
+                ++written;
+            }
+            return written;
+        }
+    }
+
+    std::shared_ptr<IComponentArray> fork() const override { return std::make_shared<ComponentArray<T>>(*this); }
+
+    void assign_from(const IComponentArray &other) override {
+        auto const &source = static_cast<const ComponentArray<T> &>(other);
+        dense_pages_ = source.dense_pages_;
+        index_ = source.index_;
+        size_ = source.size_;
+        live_ = source.live_;
+        free_slots_ = source.free_slots_;
+    }
+
+    void first_touch(WorkerPool &workers) override {
+        workers.parallel_for(dense_pages_.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t page = begin; page < end; ++page) {
+                auto copy = DensePageRef::allocate();
+                std::copy(dense_pages_[page]->data.begin(), dense_pages_[page]->data.end(), copy->data.begin());
+                copy->entities = dense_pages_[page]->entities;
+                dense_pages_[page] = std::move(copy);
+            }
+        });
+    }
+
+  private:
+    struct DensePage {
+        std::atomic<std::uint32_t> refs{1};
+        // Tags keep no data, only their owners
+        std::array<T, STORAGE == Storage::Tag ? 0 : POOL_PAGE_SIZE> data;
+        std::array<Entity, POOL_PAGE_SIZE> entities;
+
+        void recycle() {
+            // Don't keep resources owned by stale components alive on the free list
+            if constexpr (!std::is_trivially_copyable_v<T>)
+                data.fill(T{});
+        }
+    };
+
+    using DensePageRef = PageRef<DensePage>;
+
+    // The packed components (of generic type T) and their owning entities,
+    // in fixed-size pages so a forked pool can share them until written.
+    std::vector<DensePageRef> dense_pages_;
+
+    // Total size of valid entries in the array, including tombstones.
+    size_t size_{};
+    size_t live_{};
+
+    // Tombstoned slots of a stable pool, reused most recent first
+    std::vector<std::uint32_t> free_slots_;
+
+    // The one instance every entity shares in a tag pool
+    static T &tag() {
+        static T instance{};
+        return instance;
+    }
+
+    // Tags have no bytes worth keeping, generic page access sees zeros
+    static unsigned char *tag_page() {
+        static unsigned char zeros[POOL_PAGE_SIZE * sizeof(T)]{};
+        return zeros;
+    }
+
+    bool refresh(Handle &handle) const {
+        if (handle.index < size_ &&
+            dense_pages_[handle.index / POOL_PAGE_SIZE]->entities[handle.index % POOL_PAGE_SIZE] == handle.entity)
+            return handle.entity != INVALID_ENTITY;
+        handle.index = static_cast<std::uint32_t>(index_of(handle.entity));
+        return handle.index != INVALID_INDEX;
+    }
+
+    // Drop the last slot, and its page once empty
+    void shrink() {
+        --size_;
+        if (size_ % POOL_PAGE_SIZE == 0)
+            dense_pages_.pop_back();
+    }
+
+    static DensePage &writable(DensePageRef &ref) {
+        if (ref.shared()) {
+            auto copy = DensePageRef::acquire();
+            std::copy(ref->data.begin(), ref->data.end(), copy->data.begin());
+            copy->entities = ref->entities;
+            ref = std::move(copy);
+        }
+        return *ref.get();
+    }
+};
+
+// Layout and lifecycle of a component type that only exists at runtime, e.g.
+// one defined by a plugin or a data file. Hooks left null mean the bytes are
+// plain data: new components start zeroed and are copied and moved with memcpy.
+// The alignment must be a power of two no larger than
+// RuntimeComponentArray::MAX_ALIGNMENT, and a type with a destroy or move
+// hook must also have a copy hook.
+struct ComponentDescriptor {
+    std::string name;
+    std::uint32_t size = 0;
+    std::uint32_t alignment = 1;
+    std::vector<FieldInfo> fields; // Optional, lets snapshots and export see inside
+
+    void (*construct)(void *dst) = nullptr;
+    void (*destroy)(void *dst) = nullptr;
+    // Construct dst from src; src is destroyed right after
+    void (*move)(void *dst, void *src) = nullptr;
+    // Used when a page shared with a forked world is first written. Only
+    // plain data may leave it null and be copied with memcpy.
+    void (*copy)(void *dst, const void *src) = nullptr;
+
+    bool trivial() const { return !construct && !destroy && !move && !copy; }
+    // Elements are packed this far apart
+    std::uint32_t stride() const { return (size + alignment - 1) / alignment * alignment; }
+
+    TypeInfo type_info() const {
+        TypeInfo info;
+        info.name = name;
+        info.size = stride();
+        info.alignment = alignment;
+        info.trivially_copyable = trivial();
+        info.fields = fields;
+        return info;
+    }
+};
+
+// Pool for a component type described at runtime. Same paging and
+// copy-on-write sharing as ComponentArray<T>; elements are raw bytes placed
+// `stride` apart and the lifecycle hooks are plain function pointers.
+class RuntimeComponentArray : public IComponentArray {
+  public:
+    // Largest supported component alignment; ComponentManager rejects
+    // descriptors above it
+    static constexpr size_t MAX_ALIGNMENT = 64;
+
+    explicit RuntimeComponentArray(std::shared_ptr<const ComponentDescriptor> descriptor)
+        : descriptor_(std::move(descriptor)), stride_(descriptor_->stride()) {
+    }
+
+    // Construct a component for the entity and return its storage
+    void *insert_data(Entity entity) {
+        size_t new_index = size_;
+        if (new_index % POOL_PAGE_SIZE == 0)
+            dense_pages_.push_back(acquire_page());
+        auto &page = writable(dense_pages_.back());
+        void *slot = page.at(new_index % POOL_PAGE_SIZE, stride_);
+        if (descriptor_->construct)
+            descriptor_->construct(slot);
+        else
+            std::memset(slot, 0, stride_);
+        page.entities[new_index % POOL_PAGE_SIZE] = entity;
+        page.live = new_index % POOL_PAGE_SIZE + 1;
+        index_.set_index(entity, new_index);
+        ++size_;
+        return slot;
+    }
+
+    void remove_data(Entity entity) {
+        // Move the last element into the hole to stay dense
+        size_t removed = index_of(entity);
+        size_t last = size_ - 1;
+        auto &last_page = writable(dense_pages_[last / POOL_PAGE_SIZE]);
+        Entity last_entity = last_page.entities[last % POOL_PAGE_SIZE];
+        void *last_slot = last_page.at(last % POOL_PAGE_SIZE, stride_);
+        if (removed != last) {
+            auto &removed_page = writable(dense_pages_[removed / POOL_PAGE_SIZE]);
+            void *removed_slot = removed_page.at(removed % POOL_PAGE_SIZE, stride_);
+            destroy(removed_slot);
+            relocate(removed_slot, last_slot);
+            removed_page.entities[removed % POOL_PAGE_SIZE] = last_entity;
+        } else {
+            destroy(last_slot);
+        }
+        --last_page.live;
+
+        index_.set_index(last_entity, removed);
+        index_.set_index(entity, INVALID_INDEX);
 
         --size_;
+        if (size_ % POOL_PAGE_SIZE == 0)
+            dense_pages_.pop_back();
+    }
+
+    void *get_data(Entity entity) {
+        size_t index = index_of(entity);
+        return writable(dense_pages_[index / POOL_PAGE_SIZE]).at(index % POOL_PAGE_SIZE, stride_);
+    }
+
+    const void *read_data(Entity entity) const {
+        size_t index = index_of(entity);
+        return dense_pages_[index / POOL_PAGE_SIZE]->at(index % POOL_PAGE_SIZE, stride_);
+    }
+
+    const ComponentDescriptor &descriptor() const { return *descriptor_; }
+
+    void entity_destroyed(Entity entity) override {
+        if (has_data(entity))
+            remove_data(entity);
+    }
+
+    size_t size() const override { return size_; }
+    const void *page_data(size_t page) const override { return dense_pages_[page]->bytes; }
+    void *page_data(size_t page) override { return writable(dense_pages_[page]).bytes; }
+    const Entity *page_entities(size_t page) const override { return dense_pages_[page]->entities.data(); }
+
+    size_t assign_raw(const Entity *entities, const void *records, size_t count) override {
+        if (!descriptor_->trivial())
+            return 0;
+        size_t written = 0;
+        auto const *src = static_cast<const unsigned char *>(records);
+        for (size_t i = 0; i < count; ++i) {
+            if (!has_data(entities[i]))
+                continue;
+            std::memcpy(get_data(entities[i]), src + i * stride_, stride_);
+            ++written;
+        }
+        return written;
+    }
+
+    std::shared_ptr<IComponentArray> fork() const override {
+        return std::make_shared<RuntimeComponentArray>(*this);
+    }
+
+    void assign_from(const IComponentArray &other) override {
+        auto const &source = static_cast<const RuntimeComponentArray &>(other);
+        dense_pages_ = source.dense_pages_;
+        index_ = source.index_;
+        size_ = source.size_;
+    }
+
+    void first_touch(WorkerPool &workers) override {
+        workers.parallel_for(dense_pages_.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t page = begin; page < end; ++page)
+                dense_pages_[page] = copy_page(*dense_pages_[page].get(), DensePageRef::allocate());
+        });
+    }
+
+  private:
+    // Pages of every runtime type share one free list, so the byte buffer is
+    // regrown when a page is reused for a wider type
+    struct DensePage {
+        std::atomic<std::uint32_t> refs{1};
+        const ComponentDescriptor *descriptor = nullptr;
+        size_t live = 0; // Constructed elements, always a prefix of the page
+        size_t capacity = 0;
+        unsigned char *bytes = nullptr;
+        std::array<Entity, POOL_PAGE_SIZE> entities;
+
+        ~DensePage() { ::operator delete(bytes, std::align_val_t(MAX_ALIGNMENT)); }
+
+        void *at(size_t slot, size_t stride) const { return bytes + slot * stride; }
+
+        void reserve(size_t stride) {
+            if (capacity >= stride * POOL_PAGE_SIZE)
+                return;
+            ::operator delete(bytes, std::align_val_t(MAX_ALIGNMENT));
+            capacity = stride * POOL_PAGE_SIZE;
+            bytes = static_cast<unsigned char *>(::operator new(capacity, std::align_val_t(MAX_ALIGNMENT)));
+        }
+
+        void recycle() {
+            if (descriptor && descriptor->destroy)
+                for (size_t i = 0; i < live; ++i)
+                    descriptor->destroy(at(i, descriptor->stride()));
+            live = 0;
+            descriptor = nullptr;
+        }
+    };
+
+    using DensePageRef = PageRef<DensePage>;
+
+    // Declared first so it outlives the pages that point at it
+    std::shared_ptr<const ComponentDescriptor> descriptor_;
+    size_t stride_;
+    std::vector<DensePageRef> dense_pages_;
+    size_t size_{};
+
+    DensePageRef acquire_page() const {
+        auto page = DensePageRef::acquire();
+        page->reserve(stride_);
+        page->descriptor = descriptor_.get();
+        return page;
+    }
+
+    DensePage &writable(DensePageRef &ref) const {
+        if (ref.shared())
+            ref = copy_page(*ref.get(), DensePageRef::acquire());
+        return *ref.get();
+    }
+
+    // Fill `copy`, a page from the free list or a new one, with `source`
+    DensePageRef copy_page(const DensePage &source, DensePageRef copy) const {
+        copy->reserve(stride_);
+        copy->descriptor = descriptor_.get();
+        for (size_t i = 0; i < source.live; ++i) {
+            if (descriptor_->copy)
+                descriptor_->copy(copy->at(i, stride_), source.at(i, stride_));
+            else
+                std::memcpy(copy->at(i, stride_), source.at(i, stride_), stride_);
+        }
+        copy->live = source.live;
+        copy->entities = source.entities;
+        return copy;
+    }
+
+    void destroy(void *slot) const {
+        if (descriptor_->destroy)
+            descriptor_->destroy(slot);
+    }
+
+    // Move src into uninitialized dst and end src's lifetime
+    void relocate(void *dst, void *src) const {
+        if (descriptor_->move) {
+            descriptor_->move(dst, src);
+            destroy(src);
+        } else {
+            std::memcpy(dst, src, stride_);
+        }
+    }
+};
+
+// Query over component types picked at runtime. Every pool's page table is
+// resolved once up front, so visiting an entity costs index lookups and
+// pointer arithmetic, with no template instantiation per type and no virtual
+// calls per element. Pools not marked read-only are unshared when the view
+// is created, like View<Ts...>.
+class RuntimeView {
+  public:
+    struct Term {
+        IComponentArray *pool;
+        size_t stride;
+        bool read_only;
+    };
+
+    explicit RuntimeView(const std::vector<Term> &terms) {
+        for (auto const &term : terms) {
+            Column column{term.pool, term.stride, {}};
+            const IComponentArray &pool = *term.pool;
+            for (size_t page = 0; page < pool_page_count(pool.size()); ++page)
+                column.pages.push_back(term.read_only ? const_cast<void *>(pool.page_data(page))
+                                                      : term.pool->page_data(page));
+            if (columns_.empty() || pool.size() < columns_[driver_].pool->size())
+                driver_ = columns_.size();
+            columns_.push_back(std::move(column));
+        }
+    }
+
+    size_t size_hint() const { return columns_.empty() ? 0 : columns_[driver_].pool->size(); }
+
+    // Skip entities whose bit is set in `entities`, e.g. disabled ones
+    void exclude(const HierarchicalBitset *entities) { excluded_ = entities; }
+
+    // Calls fn(entity, components) for every entity having all the terms,
+    // where components[i] points at the entity's component for term i
+    template <typename F>
+    void each(F &&fn) const {
+        if (columns_.empty())
+            return;
+        std::array<void *, MAX_COMPONENTS> components;
+        const IComponentArray &driver = *columns_[driver_].pool;
+        for (size_t page = 0; page < pool_page_count(driver.size()); ++page) {
+            const Entity *entities = driver.page_entities(page);
+            size_t count = std::min(POOL_PAGE_SIZE, driver.size() - page * POOL_PAGE_SIZE);
+            for (size_t i = 0; i < count; ++i) {
+                Entity entity = entities[i];
+                if (excluded_ && excluded_->test(entity))
+                    continue;
+                bool match = true;
+                for (size_t c = 0; c < columns_.size() && match; ++c) {
+                    size_t index = columns_[c].pool->index_of(entity);
+                    match = index != INVALID_INDEX;
+                    if (match)
+                        components[c] = static_cast<unsigned char *>(columns_[c].pages[index / POOL_PAGE_SIZE]) +
+                                        index % POOL_PAGE_SIZE * columns_[c].stride;
+                }
+                if (match)
+                    fn(entity, components.data());
+            }
+        }
+    }
+
+  private:
+    struct Column {
+        IComponentArray *pool;
+        size_t stride;
+        std::vector<void *> pages;
+    };
+
+    std::vector<Column> columns_;
+    size_t driver_ = 0;
+    const HierarchicalBitset *excluded_ = nullptr;
+};
+
+template <typename... Ts>
+class ViewRange;
+template <typename... Ts>
+class ViewChunks;
+
+// Iteration over every entity that has all of Ts. Const-qualified types are
+// read-only; for the others the view unshares their pages when it is created,
+// so the callbacks may write them concurrently from any number of threads as
+// long as each entity is visited by one thread.
+//
+// The view is driven by the pool with the fewest components, and membership
+// in the others is tested cheapest storage first, hashed pools last. It can
+// be cut into splittable
+// ranges for a task splitter, or into a random-access sequence of chunks for
+// the standard parallel algorithms. Views are a few pointers, and ranges and
+// chunks hold their own copy, so none of them dangle:
+//
+//   auto chunks = world.view<Transform, const RigidBody>().chunks();
+//   std::for_each(std::execution::par_unseq, chunks.begin(), chunks.end(), [](auto range) {
+//       range.each([](Entity e, Transform &t, const RigidBody &b) { ... });
+//   });
+template <typename... Ts>
+class View {
+  public:
+    explicit View(ComponentArray<std::remove_const_t<Ts>> &...pools) : pools_(&pools...) {
+        (prepare<Ts>(pools), ...);
+    }
+
+    // Upper bound on the number of entities visited
+    size_t size_hint() const { return driver_size_; }
+
+    // Skip entities whose bit is set in `entities`, e.g. disabled ones
+    void exclude(const HierarchicalBitset *entities) { excluded_ = entities; }
+
+    // Look `distance` candidates ahead and prefetch the other pools' index
+    // entries (at twice the distance) and components. Worth it when those
+    // pools are stored in a different order than the driving one, so every
+    // lookup would otherwise miss the cache. Zero turns it off.
+    void prefetch(size_t distance) { prefetch_distance_ = std::min(distance, POOL_PAGE_SIZE / 2); }
+
+    ViewRange<Ts...> range() const { return ViewRange<Ts...>(*this, 0, driver_size_); }
+
+    // Chunks of `grain` candidates. Page-sized grains keep every chunk on one page.
+    ViewChunks<Ts...> chunks(size_t grain = POOL_PAGE_SIZE) const { return ViewChunks<Ts...>(*this, grain); }
+
+    // Calls fn(entity, components...) for every matching entity
+    template <typename F>
+    void each(F &&fn) const {
+        each_in(0, driver_size_, fn);
     }
 
-    T &get_data(Entity entity) {
-        // Return a reference to the entity's component
-        return component_array_[entity_to_index_map_[entity]];
-    }
+    // Run on our own worker pool
+    template <typename F>
+    void parallel_each(WorkerPool &workers, size_t grain, F &&fn) const {
+        workers.parallel_for(driver_size_, grain, [&](size_t begin, size_t end) { each_in(begin, end, fn); });
+    }
+
+    // Visit the candidates at the driving pool's packed indices [begin, end)
+    template <typename F>
+    void each_in(size_t begin, size_t end, F &fn) const {
+        if (prefetch_distance_) {
+            each_prefetched(begin, end, fn);
+            return;
+        }
+        for (size_t index = begin; index < end;) {
+            size_t page = index / POOL_PAGE_SIZE;
+            size_t page_end = std::min(end, (page + 1) * POOL_PAGE_SIZE);
+            const Entity *entities = driver_->page_entities(page);
+            for (; index < page_end; ++index) {
+                Entity entity = entities[index % POOL_PAGE_SIZE];
+                if (excluded_ && excluded_->test(entity))
+                    continue;
+                if ((has<Ts, false>(entity) && ...) && (has<Ts, true>(entity) && ...))
+                    fn(entity, fetch<Ts>(entity, index)...);
+            }
+        }
+    }
+
+  private:
+    std::tuple<ComponentArray<std::remove_const_t<Ts>> *...> pools_;
+    const IComponentArray *driver_ = nullptr;
+    size_t driver_size_ = 0;
+    size_t driver_live_ = 0;
+    const HierarchicalBitset *excluded_ = nullptr;
+    size_t prefetch_distance_ = 0;
+
+    // each_in() with lookahead. The distance is at most half a page, so the
+    // lookahead never reaches past the page after the current one.
+    template <typename F>
+    void each_prefetched(size_t begin, size_t end, F &fn) const {
+        // An empty pool has no page to read, and `begin` may sit on one past the last
+        if (begin >= end)
+            return;
+        const size_t distance = prefetch_distance_;
+        const size_t page_count = pool_page_count(driver_size_);
+        size_t page = begin / POOL_PAGE_SIZE;
+        const Entity *current = driver_->page_entities(page);
+        const Entity *next = page + 1 < page_count ? driver_->page_entities(page + 1) : nullptr;
+        auto entity_at = [&](size_t index) {
+            return index / POOL_PAGE_SIZE == page ? current[index % POOL_PAGE_SIZE] : next[index % POOL_PAGE_SIZE];
+        };
+
+        for (size_t index = begin; index < end; ++index) {
+            if (index / POOL_PAGE_SIZE != page) {
+                ++page;
+                current = next;
+                next = page + 1 < page_count ? driver_->page_entities(page + 1) : nullptr;
+            }
+            if (index + 2 * distance < end) {
+                Entity ahead = entity_at(index + 2 * distance);
+                (prefetch_index<Ts>(ahead), ...);
+            }
+            if (index + distance < end) {
+                Entity ahead = entity_at(index + distance);
+                (prefetch_data<Ts>(ahead), ...);
+            }
+
+            Entity entity = current[index % POOL_PAGE_SIZE];
+            if (excluded_ && excluded_->test(entity))
+                continue;
+            if ((has<Ts, false>(entity) && ...) && (has<Ts, true>(entity) && ...))
+                fn(entity, fetch<Ts>(entity, index)...);
+        }
+    }
+
+    template <typename T>
+    void prepare(ComponentArray<std::remove_const_t<T>> &pool) {
+        if constexpr (!std::is_const_v<T>)
+            pool.make_writable();
+        if (!driver_ || pool.live_count() < driver_live_) {
+            driver_ = &pool;
+            driver_size_ = pool.size();
+            driver_live_ = pool.live_count();
+        }
+    }
+
+    // The driving pool is read in order and needs no hints
+    template <typename T>
+    void prefetch_index(Entity entity) const {
+        auto *pool = std::get<ComponentArray<std::remove_const_t<T>> *>(pools_);
+        if (pool != driver_)
+            pool->prefetch_index(entity);
+    }
+
+    template <typename T>
+    void prefetch_data(Entity entity) const {
+        auto *pool = std::get<ComponentArray<std::remove_const_t<T>> *>(pools_);
+        if (pool != driver_)
+            pool->prefetch_data(entity);
+    }
+
+    // Membership test for T, in the pass for hashed pools or the one for the rest
+    template <typename T, bool Hashed>
+    bool has(Entity entity) const {
+        using Pool = ComponentArray<std::remove_const_t<T>>;
+        if constexpr ((Pool::STORAGE == Storage::Sparse) == Hashed) {
+            // The driving pool only needs its tombstones skipped
+            auto *pool = std::get<Pool *>(pools_);
+            return pool == driver_ ? entity != INVALID_ENTITY : pool->has_data(entity);
+        } else {
+            return true;
+        }
+    }
+
+    // The driving pool's component is at the packed index being visited, so
+    // only the other pools go through their entity index
+    template <typename T>
+    decltype(auto) fetch(Entity entity, size_t index) const {
+        auto *pool = std::get<ComponentArray<std::remove_const_t<T>> *>(pools_);
+        if constexpr (std::is_const_v<T>)
+            return pool == driver_ ? pool->read_at(index) : pool->read_data(entity);
+        else
+            return pool == driver_ ? pool->get_at(index) : pool->get_data(entity);
+    }
+};
+
+// Contiguous slice of a view's driving pool, splittable in halves
+template <typename... Ts>
+class ViewRange {
+  public:
+    ViewRange(const View<Ts...> &view, size_t begin, size_t end) : view_(view), begin_(begin), end_(end) {}
+
+    size_t size() const { return end_ - begin_; }
+    bool empty() const { return begin_ == end_; }
+    bool is_divisible(size_t grain) const { return size() > grain; }
+
+    // Split off the back half into its own range
+    ViewRange split() {
+        size_t middle = begin_ + size() / 2;
+        ViewRange back(view_, middle, end_);
+        end_ = middle;
+        return back;
+    }
+
+    template <typename F>
+    void each(F &&fn) const {
+        view_.each_in(begin_, end_, fn);
+    }
+
+  private:
+    View<Ts...> view_;
+    size_t begin_;
+    size_t end_;
+};
+
+// Random-access sequence of fixed-size ranges covering a view. The ranges
+// are made up front, so iterators are plain vector iterators and meet the
+// forward iterator requirements of the standard parallel algorithms.
+template <typename... Ts>
+class ViewChunks {
+  public:
+    using iterator = typename std::vector<ViewRange<Ts...>>::const_iterator;
+
+    ViewChunks(const View<Ts...> &view, size_t grain) {
+        grain = std::max<size_t>(grain, 1);
+        const size_t total = view.size_hint();
+        ranges_.reserve((total + grain - 1) / grain);
+        for (size_t begin = 0; begin < total; begin += grain)
+            ranges_.emplace_back(view, begin, std::min(total, begin + grain));
+    }
+
+    size_t size() const { return ranges_.size(); }
+    const ViewRange<Ts...> &at(size_t index) const { return ranges_[index]; }
+    iterator begin() const { return ranges_.begin(); }
+    iterator end() const { return ranges_.end(); }
+
+  private:
+    std::vector<ViewRange<Ts...>> ranges_;
+};
+
+class ComponentManager {
+  public:
+    template <typename T>
+    void register_component() {
+        const char *type_name = typeid(T).name();
+
+        // Add this component type to the component type map
+        component_types_.insert({type_name, next_component_type});
+
+        // Create a ComponentArray pointer and add it to the component arrays map
+        auto array = std::make_shared<ComponentArray<T>>();
+        component_arrays_.insert({type_name, array});
+
+        // Keep the metadata and pool indexed by component type for generic, type-erased access
+        type_infos_[next_component_type] = make_type_info<T>();
+        arrays_by_type_[next_component_type] = array;
+
+        // Increment the value so that the next component registered will be different
+        ++next_component_type;
+    }
+
+    // Register a component type that has no C++ type, see ComponentDescriptor
+    // Returns INVALID_COMPONENT, and says why on stderr, if the descriptor
+    // can't be stored as given
+    ComponentType register_component(const ComponentDescriptor &descriptor) {
+        const char *error = nullptr;
+        if (next_component_type >= MAX_COMPONENTS)
+            error = "MAX_COMPONENTS types are already registered";
+        else if (descriptor.alignment == 0 || (descriptor.alignment & (descriptor.alignment - 1)) != 0)
+            error = "alignment is not a power of two";
+        else if (descriptor.alignment > RuntimeComponentArray::MAX_ALIGNMENT)
+            error = "alignment exceeds RuntimeComponentArray::MAX_ALIGNMENT";
+        else if ((descriptor.destroy || descriptor.move) && !descriptor.copy)
+            error = "destroy or move is set without copy, so copy-on-write would share what it owns";
+        if (error) {
+            std::cerr << "pixelz: can't register component \"" << descriptor.name << "\": " << error << '\n';
+            return INVALID_COMPONENT;
+        }
+
+        auto array = std::make_shared<RuntimeComponentArray>(std::make_shared<ComponentDescriptor>(descriptor));
+        runtime_types_.insert({descriptor.name, next_component_type});
+        type_infos_[next_component_type] = descriptor.type_info();
+        arrays_by_type_[next_component_type] = array;
+        runtime_arrays_[next_component_type] = array.get();
+        return next_component_type++;
+    }
+
+    template <typename T>
+    ComponentType get_component_type() {
+        const char *type_name = typeid(T).name();
+
+        // Return this component's type - used for creating signatures
+        return component_types_[type_name];
+    }
+
+    // INVALID_COMPONENT if no runtime component has that name
+    ComponentType get_component_type(const std::string &name) const {
+        auto found = runtime_types_.find(name);
+        return found == runtime_types_.end() ? INVALID_COMPONENT : found->second;
+    }
+
+    bool is_registered(ComponentType type) const { return type < next_component_type; }
+    bool is_runtime(ComponentType type) const { return is_registered(type) && runtime_arrays_[type]; }
+
+    // Type-erased access by component type. Adding works for runtime
+    // components only and returns null for any other type; the rest also
+    // work for C++ ones. get and read return null if the entity doesn't have
+    // the component, remove does nothing.
+    void *add_component(Entity entity, ComponentType type) {
+        if (!is_runtime(type)) {
+            std::cerr << "pixelz: component type " << int(type) << " can't be added by type, it isn't a runtime one\n";
+            return nullptr;
+        }
+        return runtime_arrays_[type]->insert_data(entity);
+    }
+
+    void remove_component(Entity entity, ComponentType type) {
+        if (is_registered(type))
+            arrays_by_type_[type]->entity_destroyed(entity);
+    }
+
+    void *get_component(Entity entity, ComponentType type) {
+        if (!is_registered(type))
+            return nullptr;
+        auto &pool = *arrays_by_type_[type];
+        size_t index = pool.index_of(entity);
+        if (index == INVALID_INDEX)
+            return nullptr;
+        return static_cast<unsigned char *>(pool.page_data(index / POOL_PAGE_SIZE)) +
+               index % POOL_PAGE_SIZE * type_infos_[type].size;
+    }
+
+    const void *read_component(Entity entity, ComponentType type) const {
+        if (!is_registered(type))
+            return nullptr;
+        const IComponentArray &pool = *arrays_by_type_[type];
+        size_t index = pool.index_of(entity);
+        if (index == INVALID_INDEX)
+            return nullptr;
+        return static_cast<const unsigned char *>(pool.page_data(index / POOL_PAGE_SIZE)) +
+               index % POOL_PAGE_SIZE * type_infos_[type].size;
+    }
+
+    // Calls fn(entity) in ascending order for every entity having all the
+    // components in `all` and none of those in `none`, by ANDing the pools'
+    // membership bitsets. Entities set in `excluded` are skipped as well, and
+    // if `among` is given only entities set in it are visited. `all` must
+    // name at least one component.
+    template <typename F>
+    void for_each_match(const Signature &all, const Signature &none, const HierarchicalBitset *excluded,
+                        F &&fn, const HierarchicalBitset *among = nullptr) const {
+        std::array<const HierarchicalBitset *, MAX_COMPONENTS + 1> included;
+        std::array<const HierarchicalBitset *, MAX_COMPONENTS + 1> excluding;
+        size_t included_count = 0;
+        size_t excluding_count = 0;
+        for (ComponentType type = 0; type < next_component_type; ++type) {
+            if (all.test(type))
+                included[included_count++] = &arrays_by_type_[type]->members();
+            else if (none.test(type))
+                excluding[excluding_count++] = &arrays_by_type_[type]->members();
+        }
+        if (excluded)
+            excluding[excluding_count++] = excluded;
+        if (among)
+            included[included_count++] = among;
+        if (included_count == 0)
+            return;
+        for_each_intersection(included.data(), included_count, excluding.data(), excluding_count,
+                              [&](size_t entity) { fn(static_cast<Entity>(entity)); });
+    }
+
+    RuntimeView runtime_view(std::initializer_list<ComponentType> types, Signature read_only) {
+        std::vector<RuntimeView::Term> terms;
+        for (ComponentType type : types)
+            terms.push_back({arrays_by_type_[type].get(), type_infos_[type].size, read_only.test(type)});
+        return RuntimeView(terms);
+    }
+
+    template <typename T>
+    void add_component(Entity entity, T component) {
+        // Add a component to the array for an entity
+        get_component_array<T>()->insert_data(entity, component);
+    }
+
+    template <typename T>
+    void remove_component(Entity entity) {
+        // Remove a component from the array for an entity
+        get_component_array<T>()->remove_data(entity);
+    }
+
+    template <typename T>
+    T &get_component(Entity entity) {
+        // Get a reference to a component from the array for an entity
+        return get_component_array<T>()->get_data(entity);
+    }
+
+    template <typename T>
+    const T &read_component(Entity entity) {
+        return get_component_array<T>()->read_data(entity);
+    }
+
+    // Copy of every pool sharing pages copy-on-write with this one
+    std::unique_ptr<ComponentManager> fork() const {
+        auto forked = std::make_unique<ComponentManager>();
+        forked->component_types_ = component_types_;
+        forked->runtime_types_ = runtime_types_;
+        forked->type_infos_ = type_infos_;
+        forked->next_component_type = next_component_type;
+        for (ComponentType type = 0; type < next_component_type; ++type) {
+            forked->arrays_by_type_[type] = arrays_by_type_[type]->fork();
+            if (runtime_arrays_[type])
+                forked->runtime_arrays_[type] = static_cast<RuntimeComponentArray *>(forked->arrays_by_type_[type].get());
+        }
+        for (auto const &[type_name, type] : component_types_)
+            forked->component_arrays_.insert({type_name, forked->arrays_by_type_[type]});
+        return forked;
+    }
+
+    void first_touch(WorkerPool &workers) {
+        for (ComponentType type = 0; type < next_component_type; ++type)
+            arrays_by_type_[type]->first_touch(workers);
+    }
+
+    // Share every page of `other`, which must have the same components registered
+    void assign_from(const ComponentManager &other) {
+        for (ComponentType type = 0; type < next_component_type; ++type)
+            arrays_by_type_[type]->assign_from(*other.arrays_by_type_[type]);
+    }
+
+    const TypeInfo &get_type_info(ComponentType type) const { return type_infos_[type]; }
+
+    IComponentArray &get_component_pool(ComponentType type) { return *arrays_by_type_[type]; }
+    const IComponentArray &get_component_pool(ComponentType type) const { return *arrays_by_type_[type]; }
+
+    ComponentType component_type_count() const { return next_component_type; }
+
+    void entity_destroyed(Entity entity) {
+        // Notify each component array that an entity has been destroyed
+        // If it has a component for that entity, it will remove it
+        for (ComponentType type = 0; type < next_component_type; ++type)
+            arrays_by_type_[type]->entity_destroyed(entity);
+    }
+
+  private:
+    // Map from type string pointer to a component type
+    std::unordered_map<const char *, ComponentType> component_types_{};
+
+    // Map from type string pointer to a component array
+    std::unordered_map<const char *, std::shared_ptr<IComponentArray>> component_arrays_{};
+
+    // The component type to be assigned to the next registered component - starting at 0
+    ComponentType next_component_type{};
+
+    // Map from name to component type, for runtime components
+    std::unordered_map<std::string, ComponentType> runtime_types_{};
+
+    // Reflection metadata and pools, indexed by component type
+    std::array<TypeInfo, MAX_COMPONENTS> type_infos_{};
+    std::array<std::shared_ptr<IComponentArray>, MAX_COMPONENTS> arrays_by_type_{};
+    // Pools of runtime components, null for C++ ones
+    std::array<RuntimeComponentArray *, MAX_COMPONENTS> runtime_arrays_{};
+
+  public:
+    template <typename T>
+    ComponentArray<T> &get_pool() {
+        return *get_component_array<T>();
+    }
+
+  private:
+    // Convenience function to get the statically casted pointer to the ComponentArray of type T.
+    template <typename T>
+    std::shared_ptr<ComponentArray<T>> get_component_array() {
+        const char *type_name = typeid(T).name();
+
+        return std::static_pointer_cast<ComponentArray<T>>(component_arrays_[type_name]);
+    }
+};
+
+// The built-in systems' update(world, dt) overloads look their entities up
+// in `world` with match(signature_, ...) rather than entities_, so they also
+// run correctly against a fork whose structure has moved on from this world's.
+class System {
+  public:
+    std::set<Entity> entities_;
+    Signature signature_; // Set by SystemManager::set_signature
+};
+
+class SystemManager {
+  public:
+    template <typename T>
+    std::shared_ptr<T> register_system() {
+        const char *type_name = typeid(T).name();
+
+        // Create a pointer to the system and return it so it can be used externally
+        auto system = std::make_shared<T>();
+        systems_.insert({type_name, system});
+        return system;
+    }
+
+    template <typename T>
+    void set_signature(Signature signature) {
+        const char *type_name = typeid(T).name();
+
+        // Set the signature for this system
+        auto inserted = signatures_.insert({type_name, signature});
+        auto system = systems_.find(type_name);
+        if (system != systems_.end())
+            system->second->signature_ = inserted.first->second;
+    }
+
+    void entity_destroyed(Entity entity) {
+        // Erase a destroyed entity from all system lists
+        // mEntities is a set so no check needed
+        for (auto const &pair : systems_) {
+            auto const &system = pair.second;
+
+            system->entities_.erase(entity);
+        }
+    }
+
+    // Recompute every system's membership from scratch, e.g. after the
+    // world's entities were replaced by a saved state
+    void rebuild(EntityManager &entities) {
+        for (auto const &pair : systems_)
+            pair.second->entities_.clear();
+        for (Entity entity = 0; entity < entities.id_bound(); ++entity) {
+            auto signature = entities.get_signature(entity);
+            if (signature.any())
+                entity_signature_changed(entity, signature);
+        }
+    }
+
+    void entity_signature_changed(Entity entity, Signature entity_signature) {
+        // Notify each system that an entity's signature changed
+        for (auto const &pair : systems_) {
+            auto const &type = pair.first;
+            auto const &system = pair.second;
+            auto const &system_signature = signatures_[type];
+
+            // Entity signature matches system signature - insert into set
+            if ((entity_signature & system_signature) == system_signature) {
+                system->entities_.insert(entity);
+            }
+            // Entity signature does not match system signature - erase from set
+            else {
+                system->entities_.erase(entity);
+            }
+        }
+    }
+
+  private:
+    // Map from system type string pointer to a signature
+    std::unordered_map<const char *, Signature> signatures_{};
+
+    // Map from system type string pointer to a system pointer
+    std::unordered_map<const char *, std::shared_ptr<System>> systems_{};
+};
+
+// World-space bounds of a Transform. Rectangles hang down and to the right
+// of their position (y is up in world space).
+inline Aabb transform_bounds(const Transform &transform) {
+    return {transform.position.x, transform.position.y - transform.scale, transform.position.x + transform.scale,
+            transform.position.y};
+}
+
+// Region, radius, nearest-neighbour and raycast queries over Transform
+// bounds. The index is a snapshot: it answers for the Transforms as they were
+// at the last rebuild() or update(). Queries are const and safe to run
+// concurrently.
+//
+// update() keeps the tree current frame to frame without rebuilding it. Only
+// entities whose Transform moved outside their fat bounds touch the tree, and
+// the nodes above them are refit in parallel. Refitting degrades the tree, so
+// once enough boxes have moved a fresh tree is built on a background thread
+// and swapped in on a later update(). Creating, destroying, enabling or
+// disabling entities with a Transform forces a synchronous rebuild.
+//
+// fork() shares the tree with the copy. Whichever index updates first while
+// it is shared copies it.
+class SpatialIndex {
+  public:
+    struct Options {
+        float margin = 4.0f;            // Padding around each box, in world units
+        double rebuild_fraction = 1.0;  // Rebuild once this many boxes per entity have escaped since the last build
+        size_t rebuild_interval = 600;  // ...or after this many updates, whichever comes first
+    };
+
+    // Timings of the most recent maintenance, in milliseconds
+    struct Stats {
+        double update_ms = 0.0;  // Last update(): escape checks plus refit
+        double rebuild_ms = 0.0; // Last full build, synchronous or background
+        size_t escaped = 0;      // Boxes that left their fat bounds in the last update()
+        size_t rebuilds = 0;
+        size_t background_rebuilds = 0;
+    };
+
+    void set_options(const Options &options) { options_ = options; }
+    const Stats &stats() const { return stats_; }
+
+    // Answers like this index until either is updated. A background build
+    // in flight stays with this one.
+    SpatialIndex fork() const {
+        SpatialIndex forked;
+        forked.tree_ = tree_;
+        forked.options_ = options_;
+        forked.stats_ = stats_;
+        forked.escaped_since_build_ = escaped_since_build_;
+        forked.updates_since_build_ = updates_since_build_;
+        forked.generation_ = generation_;
+        return forked;
+    }
+
+    // Build from scratch
+    void rebuild(const View<const Transform> &view) {
+        auto start = std::chrono::steady_clock::now();
+        gather(view);
+        if (tree_.use_count() > 1)
+            tree_ = std::make_shared<Bvh4>();
+        tree_->build(boxes_.data(), ids_.data(), boxes_.size(), options_.margin);
+        built();
+        stats_.rebuild_ms = elapsed_ms(start);
+    }
+
+    void update(const View<const Transform> &view, WorkerPool &workers) {
+        auto start = std::chrono::steady_clock::now();
+        adopt_background_build();
+        if (tree_.use_count() > 1)
+            tree_ = std::make_shared<Bvh4>(*tree_);
+        Bvh4 &tree = *tree_;
+
+        // Counting visits catches entities that left the view (destroyed,
+        // disabled) without a separate pass
+        std::atomic<size_t> visited{0};
+        std::atomic<size_t> escaped{0};
+        std::atomic<bool> unknown{false};
+        workers.parallel_for(view.size_hint(), POOL_PAGE_SIZE, [&](size_t begin, size_t end) {
+            size_t block_visited = 0;
+            size_t block_escaped = 0;
+            auto check = [&](Entity entity, const Transform &transform) {
+                ++block_visited;
+                if (!tree.contains_id(entity))
+                    unknown.store(true, std::memory_order_relaxed);
+                else if (tree.update(entity, transform_bounds(transform)))
+                    ++block_escaped;
+            };
+            view.each_in(begin, end, check);
+            visited.fetch_add(block_visited, std::memory_order_relaxed);
+            escaped.fetch_add(block_escaped, std::memory_order_relaxed);
+        });
+        if (unknown || visited != tree.size()) {
+            rebuild(view);
+            stats_.update_ms = elapsed_ms(start);
+            return;
+        }
+
+        tree.refit([&](size_t count, auto &&fn) { workers.parallel_for(count, 256, fn); });
+
+        stats_.escaped = escaped;
+        escaped_since_build_ += escaped;
+        ++updates_since_build_;
+        if (!pending_.valid() && (escaped_since_build_ > options_.rebuild_fraction * tree.size() ||
+                                  updates_since_build_ >= options_.rebuild_interval))
+            start_background_build(view);
+        stats_.update_ms = elapsed_ms(start);
+    }
+
+    size_t size() const { return tree_->size(); }
+
+    void query_rect(const Aabb &region, std::vector<Entity> &out) const {
+        out.clear();
+        tree_->query_rect(region, [&](Entity entity) { out.push_back(entity); });
+    }
+
+    void query_radius(float x, float y, float radius, std::vector<Entity> &out) const {
+        out.clear();
+        tree_->query_radius(x, y, radius, [&](Entity entity) { out.push_back(entity); });
+    }
+
+    // The k nearest entities to (x, y), closest first
+    void query_nearest(float x, float y, size_t k, std::vector<Entity> &out) const {
+        tree_->query_nearest(x, y, k, out);
+    }
+
+    RayHit raycast(const Ray &ray) const { return tree_->raycast(ray); }
+
+    // Many rays at once, split across the worker pool
+    void raycast_batch(const Ray *rays, size_t count, RayHit *hits, WorkerPool &workers) const {
+        workers.parallel_for(count, 64, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+                hits[i] = tree_->raycast(rays[i]);
+        });
+    }
+
+    // Many regions at once, results[i] receives the entities in regions[i]
+    void query_rect_batch(const Aabb *regions, size_t count, std::vector<Entity> *results,
+                          WorkerPool &workers) const {
+        workers.parallel_for(count, 16, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+                query_rect(regions[i], results[i]);
+        });
+    }
+
+  private:
+    struct Built {
+        Bvh4 tree;
+        double build_ms;
+        std::uint64_t generation;
+    };
+
+    std::shared_ptr<Bvh4> tree_ = std::make_shared<Bvh4>(); // Shared with forks until one of them updates
+    std::vector<Aabb> boxes_;
+    std::vector<Entity> ids_;
+    Options options_;
+    Stats stats_;
+    size_t escaped_since_build_ = 0;
+    size_t updates_since_build_ = 0;
+    std::uint64_t generation_ = 0; // Bumped by every build so stale background results are dropped
+    std::future<Built> pending_;
+
+    static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void gather(const View<const Transform> &view) {
+        boxes_.clear();
+        ids_.clear();
+        view.each([&](Entity entity, const Transform &transform) {
+            boxes_.push_back(transform_bounds(transform));
+            ids_.push_back(entity);
+        });
+    }
+
+    void built() {
+        escaped_since_build_ = 0;
+        updates_since_build_ = 0;
+        ++generation_;
+        ++stats_.rebuilds;
+    }
+
+    // The job gets its own copy of the boxes, the world may change meanwhile
+    void start_background_build(const View<const Transform> &view) {
+        gather(view);
+        pending_ = std::async(std::launch::async, [boxes = boxes_, ids = ids_, margin = options_.margin,
+                                                   generation = generation_] {
+            auto start = std::chrono::steady_clock::now();
+            Built result{Bvh4(), 0.0, generation};
+            result.tree.build(boxes.data(), ids.data(), boxes.size(), margin);
+            result.build_ms = elapsed_ms(start);
+            return result;
+        });
+    }
+
+    // Swap in a finished background tree. Boxes that moved since its snapshot
+    // are caught by the escape checks that follow.
+    void adopt_background_build() {
+        if (!pending_.valid() ||
+            pending_.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return;
+        Built result = pending_.get();
+        // A synchronous rebuild since the snapshot makes it stale
+        if (result.generation != generation_)
+            return;
+        tree_ = std::make_shared<Bvh4>(std::move(result.tree));
+        built();
+        ++stats_.background_rebuilds;
+        stats_.rebuild_ms = result.build_ms;
+    }
+};
+
+class Coordinator {
+  public:
+    void init() {
+        // Create pointers to each manager
+        component_manager_ = std::make_unique<ComponentManager>();
+        entity_manager_ = std::make_unique<EntityManager>();
+        system_manager_ = std::make_unique<SystemManager>();
+    }
+
+    // Entity methods
+    Entity create_entity() {
+        structure_changed();
+        return entity_manager_->create_entity();
+    }
+
+    Signature get_signature(Entity entity) const { return entity_manager_->get_signature(entity); }
+
+    void destroy_entity(Entity entity) {
+        structure_changed();
+        entity_manager_->destroy_entity(entity);
+        disabled_.reset(entity);
+
+        component_manager_->entity_destroyed(entity);
+
+        system_manager_->entity_destroyed(entity);
+    }
+
+    // Component methods
+    template <typename T>
+    void register_component() {
+        component_manager_->register_component<T>();
+    }
+
+    template <typename T>
+    void add_component(Entity entity, T component) {
+        structure_changed();
+        component_manager_->add_component<T>(entity, component);
+
+        auto signature = entity_manager_->get_signature(entity);
+        signature.set(component_manager_->get_component_type<T>(), true);
+        entity_manager_->set_signature(entity, signature);
+
+        system_manager_->entity_signature_changed(entity, signature);
+    }
+
+    template <typename T>
+    void remove_component(Entity entity) {
+        structure_changed();
+        component_manager_->remove_component<T>(entity);
+
+        auto signature = entity_manager_->get_signature(entity);
+        signature.set(component_manager_->get_component_type<T>(), false);
+        entity_manager_->set_signature(entity, signature);
+
+        system_manager_->entity_signature_changed(entity, signature);
+    }
+
+    // Add several components as one structural change: the signature is
+    // written and systems are notified once, not once per component
+    template <typename... Ts>
+    void add_components(Entity entity, Ts... components) {
+        structure_changed();
+        (component_manager_->add_component<Ts>(entity, std::move(components)), ...);
+
+        auto signature = entity_manager_->get_signature(entity) | signature_of<Ts...>();
+        entity_manager_->set_signature(entity, signature);
+
+        system_manager_->entity_signature_changed(entity, signature);
+    }
+
+    template <typename... Ts>
+    void remove_components(Entity entity) {
+        structure_changed();
+        (component_manager_->remove_component<Ts>(entity), ...);
+
+        auto signature = entity_manager_->get_signature(entity) & ~signature_of<Ts...>();
+        entity_manager_->set_signature(entity, signature);
+
+        system_manager_->entity_signature_changed(entity, signature);
+    }
+
+    template <typename T>
+    T &get_component(Entity entity) {
+        return component_manager_->get_component<T>(entity);
+    }
+
+    // Prefer this for components that are only read, it never copies a
+    // page shared with a forked world
+    template <typename T>
+    const T &read_component(Entity entity) {
+        return component_manager_->read_component<T>(entity);
+    }
+
+    // Runtime component methods. The component type takes part in
+    // signatures, systems, views by type and snapshots like any other.
+    ComponentType register_component(const ComponentDescriptor &descriptor) {
+        return component_manager_->register_component(descriptor);
+    }
+
+    ComponentType get_component_type(const std::string &name) const {
+        return component_manager_->get_component_type(name);
+    }
+
+    // Returns the new component's storage, constructed per the descriptor,
+    // or null if `type` isn't a runtime component
+    void *add_component(Entity entity, ComponentType type) {
+        void *component = component_manager_->add_component(entity, type);
+        if (!component)
+            return nullptr;
+        structure_changed();
+
+        auto signature = entity_manager_->get_signature(entity);
+        signature.set(type, true);
+        entity_manager_->set_signature(entity, signature);
+
+        system_manager_->entity_signature_changed(entity, signature);
+        return component;
+    }
+
+    void remove_component(Entity entity, ComponentType type) {
+        if (!component_manager_->is_registered(type))
+            return;
+        structure_changed();
+        component_manager_->remove_component(entity, type);
+
+        auto signature = entity_manager_->get_signature(entity);
+        signature.set(type, false);
+        entity_manager_->set_signature(entity, signature);
+
+        system_manager_->entity_signature_changed(entity, signature);
+    }
+
+    // Null if the entity has no component of that type
+    void *get_component(Entity entity, ComponentType type) { return component_manager_->get_component(entity, type); }
+
+    const void *read_component(Entity entity, ComponentType type) const {
+        return component_manager_->read_component(entity, type);
+    }
+
+    // Signature with the bits of Ts set
+    template <typename... Ts>
+    Signature signature_of() {
+        Signature signature;
+        (signature.set(get_component_type<Ts>()), ...);
+        return signature;
+    }
+
+    // Bitmap query: fn(entity) for every entity with all of `all` and none
+    // of `none`, in ascending order. Pays off over views when several
+    // filters are combined or the populations are sparse.
+    template <typename F>
+    void match(const Signature &all, const Signature &none, F &&fn) const {
+        component_manager_->for_each_match(all, none, &disabled_, fn);
+    }
+
+    // match() restricted to the entities set in `among`
+    template <typename F>
+    void match(const Signature &all, const Signature &none, const HierarchicalBitset &among, F &&fn) const {
+        component_manager_->for_each_match(all, none, &disabled_, fn, &among);
+    }
+
+    size_t count_matching(const Signature &all, const Signature &none = {}) const {
+        size_t count = 0;
+        match(all, none, [&](Entity) { ++count; });
+        return count;
+    }
+
+    // Entities having every type in `types`; see RuntimeView
+    RuntimeView runtime_view(std::initializer_list<ComponentType> types, Signature read_only = {}) {
+        RuntimeView view = component_manager_->runtime_view(types, read_only);
+        view.exclude(&disabled_);
+        return view;
+    }
+
+    // Disabled entities keep their components and system membership but are
+    // skipped by views, bitmap queries, the spatial index and the built-in
+    // systems. Toggling is a single bit flip.
+    void set_enabled(Entity entity, bool enabled) {
+        if (enabled)
+            disabled_.reset(entity);
+        else
+            disabled_.set(entity);
+    }
+
+    bool is_enabled(Entity entity) const { return !disabled_.test(entity); }
+
+    // Packed pool of one component type, with random-access iterators
+    template <typename T>
+    ComponentArray<T> &pool() {
+        return component_manager_->get_pool<T>();
+    }
+
+    // Re-place every pool's pages for `workers`, see IComponentArray::first_touch
+    void first_touch(WorkerPool &workers) {
+        component_manager_->first_touch(workers);
+    }
+
+    // Compact a stable pool by at most `budget` moves, see ComponentArray::compact
+    template <typename T>
+    size_t compact(size_t budget = SIZE_MAX) {
+        size_t moved = component_manager_->get_pool<T>().compact(budget);
+        if (moved)
+            structure_changed();
+        return moved;
+    }
+
+    // Entities having all of Ts, see View
+    template <typename... Ts>
+    View<Ts...> view() {
+        View<Ts...> view(component_manager_->get_pool<std::remove_const_t<Ts>>()...);
+        view.exclude(&disabled_);
+        return view;
+    }
+
+    // Spatial query methods. Queries answer for the Transforms as of the last
+    // update_spatial_index(), which refits the index incrementally and
+    // rebuilds it only when needed. rebuild_spatial_index() always starts over.
+    void update_spatial_index() { spatial_index_.update(view<const Transform>(), WorkerPool::global()); }
+
+    void rebuild_spatial_index() { spatial_index_.rebuild(view<const Transform>()); }
+
+    SpatialIndex &spatial_index() { return spatial_index_; }
+
+    const SpatialIndex &spatial_index() const { return spatial_index_; }
+
+    void query_rect(const Aabb &region, std::vector<Entity> &out) const { spatial_index_.query_rect(region, out); }
+
+    void query_radius(float x, float y, float radius, std::vector<Entity> &out) const {
+        spatial_index_.query_radius(x, y, radius, out);
+    }
+
+    void query_nearest(float x, float y, size_t k, std::vector<Entity> &out) const {
+        spatial_index_.query_nearest(x, y, k, out);
+    }
+
+    RayHit raycast(const Ray &ray) const { return spatial_index_.raycast(ray); }
+
+    void raycast_batch(const Ray *rays, size_t count, RayHit *hits) const {
+        spatial_index_.raycast_batch(rays, count, hits, WorkerPool::global());
+    }
+
+    template <typename T>
+    ComponentType get_component_type() {
+        return component_manager_->get_component_type<T>();
+    }
+
+    // Reflection methods
+    const TypeInfo &get_component_info(ComponentType type) const { return component_manager_->get_type_info(type); }
+
+    IComponentArray &get_component_pool(ComponentType type) { return component_manager_->get_component_pool(type); }
+
+    const IComponentArray &get_component_pool(ComponentType type) const {
+        return component_manager_->get_component_pool(type);
+    }
+
+    ComponentType component_type_count() const { return component_manager_->component_type_count(); }
+
+    // System methods
+    template <typename T>
+    std::shared_ptr<T> register_system() {
+        return system_manager_->register_system<T>();
+    }
+
+    template <typename T>
+    void set_system_signature(Signature signature) {
+        system_manager_->set_signature<T>(signature);
+    }
+
+    // Fork the world for speculative ("what-if") simulation. Component pages,
+    // entity signatures and the membership and disabled bitsets are all
+    // shared copy-on-write in pages, so forking costs O(pages) and only the
+    // pages either world writes afterwards get duplicated. Sparse pools' hash
+    // tables and stable pools' free slot lists are copied whole, but those
+    // grow with the pool, not the world. The spatial index shares its tree
+    // until either world updates it. Systems are not copied: run them against
+    // the fork with their update(world, dt) overloads, which find their
+    // entities in the fork itself.
+    Coordinator fork() const {
+        Coordinator forked;
+        forked.component_manager_ = component_manager_->fork();
+        forked.entity_manager_ = std::make_unique<EntityManager>(*entity_manager_);
+        forked.system_manager_ = std::make_unique<SystemManager>();
+        forked.structure_version_ = structure_version_;
+        forked.disabled_ = disabled_;
+        forked.spatial_index_ = spatial_index_.fork();
+        return forked;
+    }
+
+    // Saved world state for rollback. It holds page references, so saving
+    // costs O(pages), as forking does, and every page left unchanged stays
+    // shared with the live world. Entity bookkeeping is only copied when the
+    // world's structure (entities and their signatures) differs from what the
+    // state holds.
+    struct State {
+        std::unique_ptr<ComponentManager> components;
+        std::unique_ptr<EntityManager> entities;
+        std::uint64_t structure_version = 0;
+        HierarchicalBitset disabled;
+    };
+
+    // Once a state has been saved into, saving again doesn't allocate as
+    // long as no components were registered in between
+    void save_state(State &state) const {
+        if (!state.components ||
+            state.components->component_type_count() != component_manager_->component_type_count())
+            state.components = component_manager_->fork();
+        else
+            state.components->assign_from(*component_manager_);
+
+        if (!state.entities)
+            state.entities = std::make_unique<EntityManager>(*entity_manager_);
+        else if (state.structure_version != structure_version_)
+            *state.entities = *entity_manager_;
+        state.structure_version = structure_version_;
+        state.disabled = disabled_;
+    }
+
+    // Component data is restored in O(pages). If entities were created or
+    // destroyed, or components added or removed, since the state was saved,
+    // entity bookkeeping is copied back and system membership rebuilt, which
+    // visits every entity.
+    void restore_state(const State &state) {
+        if (state.components->component_type_count() != component_manager_->component_type_count())
+            component_manager_ = state.components->fork();
+        else
+            component_manager_->assign_from(*state.components);
+
+        if (state.structure_version != structure_version_) {
+            *entity_manager_ = *state.entities;
+            structure_version_ = state.structure_version;
+            system_manager_->rebuild(*entity_manager_);
+        }
+        disabled_ = state.disabled;
+    }
+
+  private:
+    std::unique_ptr<ComponentManager> component_manager_;
+    std::unique_ptr<EntityManager> entity_manager_;
+    std::unique_ptr<SystemManager> system_manager_;
+    SpatialIndex spatial_index_;
+    HierarchicalBitset disabled_;
+
+    // Label of the world's current structure. Labels are unique across all
+    // worlds, so equal labels mean identical entities and signatures.
+    std::uint64_t structure_version_{};
+
+    void structure_changed() {
+        static std::atomic<std::uint64_t> next_version{0};
+        structure_version_ = ++next_version;
+    }
+};
+
+// The last N ticks of world state for rollback and resimulation, e.g. when
+// late network input for an earlier tick arrives. Slots share unchanged
+// pages with each other and the live world, so each tick only costs the
+// pages written during it. Saving, restoring and resimulating don't allocate
+// once every slot has been used, unless the world's structure changes.
+class RollbackBuffer {
+  public:
+    explicit RollbackBuffer(size_t capacity) : slots_(capacity) {}
+
+    // Save the state at the start of `tick`
+    void save(const Coordinator &world, std::uint64_t tick) {
+        auto &slot = slots_[tick % slots_.size()];
+        world.save_state(slot.state);
+        slot.tick = tick;
+        slot.valid = true;
+    }
+
+    bool contains(std::uint64_t tick) const {
+        auto const &slot = slots_[tick % slots_.size()];
+        return slot.valid && slot.tick == tick;
+    }
+
+    // Rewind the world to the start of `tick`
+    bool restore(Coordinator &world, std::uint64_t tick) {
+        if (!contains(tick))
+            return false;
+        world.restore_state(slots_[tick % slots_.size()].state);
+        return true;
+    }
+
+    // Rewind to the start of `from` and call step(world, tick) for each tick
+    // in [from, to), re-saving the corrected state of every tick on the way.
+    // The world is left at the start of `to`.
+    template <typename Step>
+    bool resimulate(Coordinator &world, std::uint64_t from, std::uint64_t to, Step &&step) {
+        if (!restore(world, from))
+            return false;
+        for (std::uint64_t tick = from; tick < to; ++tick) {
+            step(world, tick);
+            save(world, tick + 1);
+        }
+        return true;
+    }
+
+  private:
+    struct Slot {
+        Coordinator::State state;
+        std::uint64_t tick = 0;
+        bool valid = false;
+    };
+
+    std::vector<Slot> slots_;
+};
+
+// Decoded component state of one replay frame
+struct PoolSnapshot {
+    ComponentType type;
+    std::uint32_t record_size;
+    std::vector<Entity> entities;
+    std::vector<std::uint8_t> records;
+};
+
+struct WorldSnapshot {
+    std::vector<PoolSnapshot> pools;
+};
+
+struct SnapshotOptions {
+    // World units per quantization step for float components
+    float precision = 1.0f / 256.0f;
+    // Components per independently coded (and independently threaded)
+    // chunk, rounded up to whole pool pages
+    size_t chunk_size = 4096;
+    // A full keyframe every this many frames, deltas against it in between
+    std::uint32_t keyframe_interval = 60;
+};
+
+// Records quantized, delta coded snapshots of every trivially copyable
+// component pool. Components made only of floats are quantized to
+// SnapshotOptions::precision; other plain-data components are stored
+// losslessly. Each frame stores its deltas against the most recent keyframe,
+// so decoding any frame touches at most two frames. Pools are coded in
+// independent chunks of whole pages, encoded and decoded in parallel.
+class Replay {
+  public:
+    explicit Replay(SnapshotOptions options = {})
+        : options_(options),
+          chunk_pages_(std::max<size_t>(1, (options.chunk_size + POOL_PAGE_SIZE - 1) / POOL_PAGE_SIZE)) {}
+
+    void record(Coordinator &world) {
+        const bool keyframe = frames_.empty() || frames_.size() - frames_.back().keyframe >= options_.keyframe_interval;
+
+        Frame frame;
+        frame.keyframe = keyframe ? frames_.size() : frames_.back().keyframe;
+        if (keyframe)
+            encode_key_.clear();
+
+        for (ComponentType type = 0; type < world.component_type_count(); ++type) {
+            auto const &info = world.get_component_info(type);
+            if (!info.trivially_copyable)
+                continue;
+
+            auto &pool = world.get_component_pool(type);
+            EncodedPool encoded;
+            encoded.type = type;
+            encoded.record_size = info.size;
+            encoded.count = static_cast<std::uint32_t>(pool.size());
+            encoded.quantized = info.all_float32();
+            encoded.chunks.resize((pool_page_count(pool.size()) + chunk_pages_ - 1) / chunk_pages_);
+
+            KeyPool *key = keyframe ? &encode_key_.emplace_back() : find_key(encode_key_, type);
+            if (keyframe) {
+                key->type = type;
+                key->entities.resize(pool.size());
+                if (encoded.quantized)
+                    key->quantized.resize(pool.size() * info.size / sizeof(float));
+                else
+                    key->bytes.resize(pool.size() * info.size);
+            }
+
+            const IComponentArray &const_pool = pool;
+            WorkerPool::global().parallel_for(encoded.chunks.size(), 1, [&](size_t begin, size_t end) {
+                thread_local EncodeScratch scratch;
+                for (size_t chunk = begin; chunk < end; ++chunk)
+                    encode_chunk(encoded, const_pool, keyframe, key, chunk, scratch);
+            });
+
+            frame.pools.push_back(std::move(encoded));
+        }
+        frames_.push_back(std::move(frame));
+    }
+
+    size_t frame_count() const { return frames_.size(); }
+
+    size_t encoded_bytes() const {
+        size_t bytes = 0;
+        for (auto const &frame : frames_)
+            for (auto const &pool : frame.pools)
+                for (auto const &chunk : pool.chunks)
+                    bytes += chunk.size();
+        return bytes;
+    }
+
+    // Decode a frame. The last decoded keyframe is cached, so scrubbing
+    // between frames that share a keyframe only decodes the delta frames.
+    bool decode(size_t index, WorldSnapshot &out) {
+        const Frame &frame = frames_[index];
+        if (decode_key_frame_ != frame.keyframe) {
+            decode_key_frame_ = SIZE_MAX;
+            if (!decode_frame(frames_[frame.keyframe], true, out))
+                return false;
+            decode_key_frame_ = frame.keyframe;
+            if (index == frame.keyframe)
+                return true;
+        }
+        return decode_frame(frame, false, out);
+    }
+
+    // Write a decoded frame back into the world's pools
+    static void apply(const WorldSnapshot &snapshot, Coordinator &world) {
+        for (auto const &pool : snapshot.pools)
+            world.get_component_pool(pool.type)
+                .assign_raw(pool.entities.data(), pool.records.data(), pool.entities.size());
+    }
+
+  private:
+    struct EncodedPool {
+        ComponentType type;
+        std::uint32_t record_size;
+        std::uint32_t count;
+        bool quantized;
+        std::vector<std::vector<std::uint8_t>> chunks;
+    };
+
+    struct Frame {
+        size_t keyframe;
+        std::vector<EncodedPool> pools;
+    };
+
+    // Keyframe state that deltas are coded against
+    struct KeyPool {
+        ComponentType type;
+        std::vector<Entity> entities;
+        std::vector<std::int32_t> quantized;
+        std::vector<std::uint8_t> bytes;
+    };
+
+    // A chunk spanning several pages is gathered here to be coded in one piece
+    struct EncodeScratch {
+        codec::Scratch codec;
+        std::vector<Entity> entities;
+        std::vector<std::uint8_t> records;
+    };
+
+    // Chunk flags
+    static constexpr std::uint8_t DELTA = 1;
+
+    SnapshotOptions options_;
+    size_t chunk_pages_;
+    std::vector<Frame> frames_;
+    std::vector<KeyPool> encode_key_;
+    std::vector<KeyPool> decode_key_;
+    size_t decode_key_frame_ = SIZE_MAX;
+
+    static KeyPool *find_key(std::vector<KeyPool> &keys, ComponentType type) {
+        for (auto &key : keys)
+            if (key.type == type)
+                return &key;
+        return nullptr;
+    }
+
+    void encode_chunk(EncodedPool &encoded, const IComponentArray &pool, bool keyframe, KeyPool *key, size_t chunk,
+                      EncodeScratch &scratch) {
+        const size_t begin = chunk * chunk_pages_ * POOL_PAGE_SIZE;
+        const size_t count = std::min<size_t>(chunk_pages_ * POOL_PAGE_SIZE, encoded.count - begin);
+        const size_t lanes = encoded.record_size / sizeof(float);
+        const size_t first_page = begin / POOL_PAGE_SIZE;
+        auto const *records = static_cast<const std::uint8_t *>(pool.page_data(first_page));
+        const Entity *entities = pool.page_entities(first_page);
+        if (count > POOL_PAGE_SIZE) {
+            scratch.entities.resize(count);
+            scratch.records.resize(count * encoded.record_size);
+            for (size_t done = 0; done < count; done += POOL_PAGE_SIZE) {
+                const size_t page = first_page + done / POOL_PAGE_SIZE;
+                const size_t n = std::min<size_t>(POOL_PAGE_SIZE, count - done);
+                std::copy_n(pool.page_entities(page), n, scratch.entities.begin() + done);
+                std::copy_n(static_cast<const std::uint8_t *>(pool.page_data(page)), n * encoded.record_size,
+                            scratch.records.begin() + done * encoded.record_size);
+            }
+            records = scratch.records.data();
+            entities = scratch.entities.data();
+        }
+
+        if (keyframe) {
+            std::copy_n(entities, count, key->entities.begin() + begin);
+            if (!encoded.quantized)
+                std::copy_n(records, count * encoded.record_size, key->bytes.begin() + begin * encoded.record_size);
+        }
 
-    void entity_destroyed(Entity entity) override {
-        if (entity_to_index_map_.find(entity) != entity_to_index_map_.end()) {
-            // Remove the entity's component if it existed
-            remove_data(entity);
+        // Delta code only when the chunk holds exactly the keyframe's entities in the same order
+        const bool delta = !keyframe && key && begin + count <= key->entities.size() &&
+                           std::equal(entities, entities + count, key->entities.begin() + begin);
+
+        auto &out = encoded.chunks[chunk];
+        out.push_back(delta ? DELTA : 0);
+        codec::put_u32(out, static_cast<std::uint32_t>(count));
+        if (!delta)
+            codec::encode_ids(entities, count, scratch.codec, out);
+
+        if (encoded.quantized) {
+            std::int32_t *quantized = keyframe ? key->quantized.data() + begin * lanes : nullptr;
+            const std::int32_t *reference = delta ? key->quantized.data() + begin * lanes : nullptr;
+            codec::encode_floats(reinterpret_cast<const float *>(records), count * lanes, options_.precision,
+                                 reference, quantized, scratch.codec, out);
+        } else {
+            const std::uint8_t *reference = delta ? key->bytes.data() + begin * encoded.record_size : nullptr;
+            codec::encode_bytes(records, count * encoded.record_size, reference, scratch.codec, out);
         }
     }
 
-  private:
-    // The packed array of components (of generic type T),
-    // set to a specified maximum amount, matching the maximum number
-    // of entities allowed to exist simultaneously, so that each entity
-    // has a unique spot.
-    std::array<T, MAX_ENTITIES> component_array_;
-
-    // Map from an entity ID to an array index.
-    std::unordered_map<Entity, size_t> entity_to_index_map_;
+    bool decode_frame(const Frame &frame, bool keyframe, WorldSnapshot &out) {
+        if (keyframe)
+            decode_key_.clear();
+        out.pools.resize(frame.pools.size());
+
+        for (size_t p = 0; p < frame.pools.size(); ++p) {
+            auto const &encoded = frame.pools[p];
+            auto &pool = out.pools[p];
+            pool.type = encoded.type;
+            pool.record_size = encoded.record_size;
+            pool.entities.resize(encoded.count);
+            pool.records.resize(size_t{encoded.count} * encoded.record_size);
+
+            KeyPool *key = keyframe ? &decode_key_.emplace_back() : find_key(decode_key_, encoded.type);
+            if (keyframe) {
+                key->type = encoded.type;
+                key->quantized.resize(encoded.quantized ? pool.records.size() / sizeof(float) : 0);
+            }
 
-    // Map from an array index to an entity ID.
-    std::unordered_map<size_t, Entity> index_to_entity_map_;
+            std::atomic<bool> ok{true};
+            WorkerPool::global().parallel_for(encoded.chunks.size(), 1, [&](size_t begin, size_t end) {
+                thread_local codec::Scratch scratch;
+                for (size_t chunk = begin; chunk < end; ++chunk)
+                    if (!decode_chunk(encoded, keyframe, key, chunk, pool, scratch))
+                        ok = false;
+            });
+            if (!ok)
+                return false;
+
+            if (keyframe) {
+                key->entities = pool.entities;
+                if (!encoded.quantized)
+                    key->bytes = pool.records;
+            }
+        }
+        return true;
+    }
 
-    // Total size of valid entries in the array.
-    size_t size_;
+    bool decode_chunk(const EncodedPool &encoded, bool keyframe, KeyPool *key, size_t chunk, PoolSnapshot &pool,
+                      codec::Scratch &scratch) const {
+        auto const &bytes = encoded.chunks[chunk];
+        const std::uint8_t *cursor = bytes.data();
+        const std::uint8_t *end = cursor + bytes.size();
+        const size_t begin = chunk * chunk_pages_ * POOL_PAGE_SIZE;
+        const size_t lanes = encoded.record_size / sizeof(float);
+
+        if (cursor == end)
+            return false;
+        const bool delta = *cursor++ & DELTA;
+        std::uint32_t count;
+        if (!codec::get_u32(cursor, end, count) || begin + count > encoded.count)
+            return false;
+        if (delta && (!key || begin + count > key->entities.size()))
+            return false;
+
+        if (delta)
+            std::copy_n(key->entities.begin() + begin, count, pool.entities.begin() + begin);
+        else if (!codec::decode_ids(cursor, end, count, scratch, pool.entities.data() + begin))
+            return false;
+
+        auto *records = pool.records.data() + begin * encoded.record_size;
+        if (encoded.quantized) {
+            std::int32_t *quantized = keyframe ? key->quantized.data() + begin * lanes : nullptr;
+            const std::int32_t *reference = delta ? key->quantized.data() + begin * lanes : nullptr;
+            return codec::decode_floats(cursor, end, count * lanes, options_.precision, reference, quantized, scratch,
+                                        reinterpret_cast<float *>(records));
+        }
+        const std::uint8_t *reference = delta ? key->bytes.data() + begin * encoded.record_size : nullptr;
+        return codec::decode_bytes(cursor, end, count * encoded.record_size, reference, records);
+    }
 };
 
-class ComponentManager {
+// A parse_query() query compiled against one world's components. The
+// component lists become signature masks for a bitmap match, and every
+// comparison becomes a filter over the packed column of its field, run page
+// by page on a WorkerPool with float fields compared four at a time in SIMD.
+// A compiled query runs against the world it was compiled for or any fork
+// of it, any number of times. Disabled entities never match.
+//
+//   auto query = WorldQuery::compile(world, "Transform, RigidBody, !Fluid where position.y < 0");
+//   auto below = query.run_async(world, tooling_workers); // query.error() says why if !query.ok()
+//   ...
+//   size_t count = below.get().count;
+class WorldQuery {
   public:
-    template <typename T>
-    void register_component() {
-        const char *type_name = typeid(T).name();
-
-        // Add this component type to the component type map
-        component_types_.insert({type_name, next_component_type});
+    struct Result {
+        size_t count = 0;
+        std::vector<Entity> entities; // The first `limit` matches, ascending
+    };
 
-        // Create a ComponentArray pointer and add it to the component arrays map
-        component_arrays_.insert({type_name, std::make_shared<ComponentArray<T>>()});
+    static WorldQuery compile(const Coordinator &world, std::string_view text) {
+        WorldQuery query;
+        ParsedQuery parsed = parse_query(text);
+        if (!parsed.ok()) {
+            query.error_ = parsed.error;
+            return query;
+        }
 
-        // Increment the value so that the next component registered will be different
-        ++next_component_type;
+        for (auto const &name : parsed.with)
+            if (!query.add_term(world, name, query.all_))
+                return query;
+        for (auto const &name : parsed.without)
+            if (!query.add_term(world, name, query.none_))
+                return query;
+        for (auto const &comparison : parsed.where)
+            if (!query.add_filter(world, comparison))
+                return query;
+
+        if (query.all_.none())
+            query.error_ = "a query needs a component that isn't negated";
+        return query;
     }
 
-    template <typename T>
-    ComponentType get_component_type() {
-        const char *type_name = typeid(T).name();
+    bool ok() const { return error_.empty(); }
+    const std::string &error() const { return error_; }
+
+    // Runs on the calling thread and `workers`, against the world as it is
+    Result run(const Coordinator &world, WorkerPool &workers, size_t limit = SIZE_MAX) const {
+        Result result;
+        if (!ok())
+            return result;
+
+        auto collect = [&](Entity entity) {
+            if (result.count++ < limit)
+                result.entities.push_back(entity);
+        };
+        if (filters_.empty()) {
+            world.match(all_, none_, collect);
+            return result;
+        }
 
-        // Return this component's type - used for creating signatures
-        return component_types_[type_name];
+        // Each filter narrows down the entities passing the ones before it
+        HierarchicalBitset passing, next;
+        for (size_t f = 0; f < filters_.size(); ++f) {
+            next.clear();
+            filter(world, filters_[f], workers, f == 0 ? nullptr : &passing, next);
+            std::swap(passing, next);
+        }
+        world.match(all_, none_, passing, collect);
+        return result;
     }
 
-    template <typename T>
-    void add_component(Entity entity, T component) {
-        // Add a component to the array for an entity
-        get_component_array<T>()->insert_data(entity, component);
+    // Runs against a fork of `world` on a thread of its own, so the world can
+    // keep simulating, structural changes included. Forking shares pages
+    // copy-on-write, so the cost to the caller is O(pages). Results describe
+    // the world as it was at the call. With WorkerPool::global(), whichever
+    // of the query and the simulation starts a parallel loop second runs it
+    // on its own thread alone, so tooling does best with a small pool of its own.
+    std::future<Result> run_async(const Coordinator &world, WorkerPool &workers, size_t limit = SIZE_MAX) const {
+        auto snapshot = std::make_shared<Coordinator>(world.fork());
+        return std::async(std::launch::async, [query = *this, snapshot, &workers, limit] {
+            return query.run(*snapshot, workers, limit);
+        });
     }
 
-    template <typename T>
-    void remove_component(Entity entity) {
-        // Remove a component from the array for an entity
-        get_component_array<T>()->RemoveData(entity);
+  private:
+    struct Filter {
+        ComponentType type;
+        FieldInfo field;
+        CompareOp op;
+        double value;
+    };
+
+    Signature all_, none_;
+    std::vector<Filter> filters_;
+    std::string error_;
+
+    static bool find_type(const Coordinator &world, std::string_view name, ComponentType &type) {
+        for (type = 0; type < world.component_type_count(); ++type)
+            if (world.get_component_info(type).name == name)
+                return true;
+        return false;
     }
 
-    template <typename T>
-    T &get_component(Entity entity) {
-        // Get a reference to a component from the array for an entity
-        return get_component_array<T>()->get_data(entity);
+    bool add_term(const Coordinator &world, const std::string &name, Signature &signature) {
+        ComponentType type;
+        if (!find_type(world, name, type)) {
+            error_ = "unknown component " + name;
+            return false;
+        }
+        signature.set(type);
+        return true;
     }
 
-    void entity_destroyed(Entity entity) {
-        // Notify each component array that an entity has been destroyed
-        // If it has a component for that entity, it will remove it
-        for (auto const &pair : component_arrays_) {
-            auto const &component = pair.second;
+    // A field is named by its path or the trailing segments of it, e.g. "y"
+    // for "position.y", optionally after "Component.". Unqualified, exactly
+    // one field of the required components may match.
+    bool add_filter(const Coordinator &world, const ParsedQuery::Comparison &comparison) {
+        std::string_view path = comparison.path;
+        Signature candidates = all_;
+        ComponentType type;
+        const size_t dot = path.find('.');
+        if (dot != std::string_view::npos && find_type(world, path.substr(0, dot), type)) {
+            candidates.reset();
+            candidates.set(type);
+            path.remove_prefix(dot + 1);
+        }
 
-            component->entity_destroyed(entity);
+        const FieldInfo *field = nullptr;
+        for (ComponentType candidate = 0; candidate < world.component_type_count(); ++candidate) {
+            if (!candidates.test(candidate))
+                continue;
+            auto const &info = world.get_component_info(candidate);
+            for (auto const &found : info.fields) {
+                const std::string_view name = found.name;
+                const bool matches = name == path || (name.size() > path.size() && name.ends_with(path) &&
+                                                      name[name.size() - path.size() - 1] == '.');
+                if (!matches)
+                    continue;
+                if (field) {
+                    error_ = "ambiguous field " + comparison.path + ": " + world.get_component_info(type).name + "." +
+                             field->name + " or " + info.name + "." + found.name;
+                    return false;
+                }
+                field = &found;
+                type = candidate;
+            }
         }
+        if (!field) {
+            error_ = "unknown field " + comparison.path;
+            return false;
+        }
+        if (!comparable(*field)) {
+            error_ = "field " + comparison.path + " isn't a number";
+            return false;
+        }
+        // Comparing a component's field requires the component
+        all_.set(type);
+        filters_.push_back({type, *field, comparison.op, comparison.value});
+        return true;
     }
 
-  private:
-    // Map from type string pointer to a component type
-    std::unordered_map<const char *, ComponentType> component_types_{};
+    // Set in `out` the entities of the filter's pool whose field passes, and
+    // that are set in `among` if given
+    static void filter(const Coordinator &world, const Filter &filter, WorkerPool &workers,
+                       const HierarchicalBitset *among, HierarchicalBitset &out) {
+        const IComponentArray &pool = world.get_component_pool(filter.type);
+        const size_t stride = world.get_component_info(filter.type).size;
+        const bool floats = filter.field.type == FieldType::Float32;
+        std::vector<std::vector<Entity>> passing(pool_page_count(pool.size()));
+
+        workers.parallel_for(passing.size(), 1, [&](size_t begin, size_t end) {
+            thread_local std::vector<float> float_column(POOL_PAGE_SIZE);
+            thread_local std::vector<double> double_column(POOL_PAGE_SIZE);
+            std::uint64_t mask[POOL_PAGE_SIZE / 64];
+            for (size_t page = begin; page < end; ++page) {
+                const size_t count = std::min(POOL_PAGE_SIZE, pool.size() - page * POOL_PAGE_SIZE);
+                const void *records = pool.page_data(page);
+                if (floats) {
+                    pack_column(filter.field, stride, records, count, float_column.data());
+                    compare_column(float_column.data(), count, filter.op, static_cast<float>(filter.value), mask);
+                } else {
+                    load_column(filter.field, stride, records, count, double_column.data());
+                    compare_column(double_column.data(), count, filter.op, filter.value, mask);
+                }
+                const Entity *entities = pool.page_entities(page);
+                for (size_t w = 0; w < (count + 63) / 64; ++w)
+                    for (std::uint64_t bits = mask[w]; bits; bits &= bits - 1) {
+                        const Entity entity = entities[w * 64 + static_cast<size_t>(__builtin_ctzll(bits))];
+                        // Stable pools' tombstones belong to no entity
+                        if (entity != INVALID_ENTITY && (!among || among->test(entity)))
+                            passing[page].push_back(entity);
+                    }
+            }
+        });
 
-    // Map from type string pointer to a component array
-    std::unordered_map<const char *, std::shared_ptr<IComponentArray>> component_arrays_{};
+        for (auto const &entities : passing)
+            for (Entity entity : entities)
+                out.set(entity);
+    }
+};
 
-    // The component type to be assigned to the next registered component - starting at 0
-    ComponentType next_component_type{};
+Coordinator gCoordinator;
 
-    // Convenience function to get the statically casted pointer to the ComponentArray of type T.
-    template <typename T>
-    std::shared_ptr<ComponentArray<T>> get_component_array() {
-        const char *type_name = typeid(T).name();
+// Rigid bodies that are also Fluid particles behave as a fluid: update()
+// turns SphFluid's pressure and viscosity forces into velocity changes, which
+// PhysicsSystem then integrates with gravity and colliders like any other
+// body's. Run it before PhysicsSystem::update().
+class FluidSystem : public System {
+  public:
+    void init(){};
+    void set_options(const SphFluid::Options &options) { fluid_.set_options(options); }
+    const SphFluid &fluid() const { return fluid_; }
 
-        return std::static_pointer_cast<ComponentArray<T>>(component_arrays_[type_name]);
+    bool contains(const Coordinator &world, Entity entity) const {
+        return (world.get_signature(entity) & signature_) == signature_;
     }
-};
 
-class System {
-  public:
-    std::set<Entity> entities_;
+    void update(float dt) { update(gCoordinator, dt); }
+    void update(Coordinator &world, float dt) {
+        bodies_.clear();
+        x_.clear();
+        y_.clear();
+        vx_.clear();
+        vy_.clear();
+        world.match(signature_, {}, [&](Entity entity) {
+            auto &rigidBody = world.get_component<RigidBody>(entity);
+            auto const &transform = world.read_component<Transform>(entity);
+            bodies_.push_back(&rigidBody);
+            x_.push_back(transform.position.x);
+            y_.push_back(transform.position.y);
+            vx_.push_back(rigidBody.velocity.x);
+            vy_.push_back(rigidBody.velocity.y);
+        });
+
+        ax_.resize(bodies_.size());
+        ay_.resize(bodies_.size());
+        fluid_.step(x_.data(), y_.data(), vx_.data(), vy_.data(), bodies_.size(), ax_.data(), ay_.data(),
+                    WorkerPool::global());
+        for (size_t i = 0; i < bodies_.size(); ++i)
+            bodies_[i]->velocity += raylib::Vector2{ax_[i], ay_[i]} * dt;
+    }
+
+  private:
+    SphFluid fluid_;
+    std::vector<RigidBody *> bodies_;
+    std::vector<float> x_, y_, vx_, vy_, ax_, ay_;
 };
 
-class SystemManager {
+// Rigid bodies with a Mass pull on each other. update() adds the
+// accelerations from BarnesHut to their velocities, which PhysicsSystem then
+// integrates. Run it before PhysicsSystem::update().
+class GravitationSystem : public System {
   public:
-    template <typename T>
-    std::shared_ptr<T> register_system() {
-        const char *type_name = typeid(T).name();
-
-        // Create a pointer to the system and return it so it can be used externally
-        auto system = std::make_shared<T>();
-        systems_.insert({type_name, system});
-        return system;
+    void init(){};
+    void set_options(const BarnesHut::Options &options) { tree_.set_options(options); }
+    const BarnesHut &tree() const { return tree_; }
+
+    void update(float dt) { update(gCoordinator, dt); }
+    void update(Coordinator &world, float dt) {
+        bodies_.clear();
+        x_.clear();
+        y_.clear();
+        mass_.clear();
+        world.match(signature_, {}, [&](Entity entity) {
+            auto const &transform = world.read_component<Transform>(entity);
+            bodies_.push_back(&world.get_component<RigidBody>(entity));
+            x_.push_back(transform.position.x);
+            y_.push_back(transform.position.y);
+            mass_.push_back(world.read_component<Mass>(entity).value);
+        });
+
+        ax_.resize(bodies_.size());
+        ay_.resize(bodies_.size());
+        tree_.step(x_.data(), y_.data(), mass_.data(), bodies_.size(), ax_.data(), ay_.data(), WorkerPool::global());
+        for (size_t i = 0; i < bodies_.size(); ++i)
+            bodies_[i]->velocity += raylib::Vector2{ax_[i], ay_[i]} * dt;
     }
 
-    template <typename T>
-    void set_signature(Signature signature) {
-        const char *type_name = typeid(T).name();
+  private:
+    BarnesHut tree_;
+    std::vector<RigidBody *> bodies_;
+    std::vector<float> x_, y_, mass_, ax_, ay_;
+};
 
-        // Set the signature for this system
-        signatures_.insert({type_name, signature});
-    }
+// Integrates bodies in fixed-size sub-steps and stops them at
+// StaticColliders, which must be registered with the world. A body that
+// moves less than its own size in a sub-step can't skip past a collider, so
+// it is only checked for overlap where it ends up. Faster bodies sweep their
+// box along the step and stop at the first collider it touches.
+//
+// Bodies also push each other apart. Overlapping pairs found at the start of
+// the frame become contacts for a ContactSolver, which corrects velocities in
+// every sub-step before the bodies move. A body's mass is its area.
+class PhysicsSystem : public System {
+  public:
+    struct Options {
+        float max_substep = 1.0f / 120.0f; // Longest sub-step, in seconds
+        int max_substeps = 8;              // Long frames take longer sub-steps beyond this
+        float restitution = 0.0f;          // Fraction of the normal velocity kept on impact
+        bool body_contacts = true;         // Collide bodies with each other
+        ContactSolver::Options solver;
+    };
 
-    void entity_destroyed(Entity entity) {
-        // Erase a destroyed entity from all system lists
-        // mEntities is a set so no check needed
-        for (auto const &pair : systems_) {
-            auto const &system = pair.second;
+    // Counts for the most recent update()
+    struct Stats {
+        int substeps = 0;
+        size_t swept = 0;         // Body sub-steps that needed a swept test
+        size_t contacts = 0;      // Collisions with static colliders resolved
+        size_t body_contacts = 0; // Overlapping body pairs handed to the solver
+        size_t colors = 0;        // Independent batches they were split into
+    };
 
-            system->entities_.erase(entity);
-        }
+    void init(){};
+    void set_options(const Options &options) {
+        options_ = options;
+        solver_.set_options(options.solver);
     }
+    const Stats &stats() const { return stats_; }
+
+    // Leave contacts between two of `fluid`'s particles to its pressure
+    void set_fluid(std::shared_ptr<const FluidSystem> fluid) { fluid_ = std::move(fluid); }
+
+    void update(float dt) { update(gCoordinator, dt); }
+    void update(Coordinator &world, float dt) {
+        gather_colliders(world);
+        gather_bodies(world);
+        stats_ = {};
+        stats_.substeps = std::clamp((int)std::ceil(dt / options_.max_substep), 1, std::max(1, options_.max_substeps));
+        const float step = dt / stats_.substeps;
+
+        const bool contacts = options_.body_contacts && find_contacts();
+        if (contacts) {
+            solver_.prepare(contacts_, inv_mass_.data(), bodies_.size(), dt);
+            stats_.body_contacts = solver_.contact_count();
+            stats_.colors = solver_.color_count();
+        }
 
-    void entity_signature_changed(Entity entity, Signature entity_signature) {
-        // Notify each system that an entity's signature changed
-        for (auto const &pair : systems_) {
-            auto const &type = pair.first;
-            auto const &system = pair.second;
-            auto const &system_signature = signatures_[type];
-
-            // Entity signature matches system signature - insert into set
-            if ((entity_signature & system_signature) == system_signature) {
-                system->entities_.insert(entity);
+        for (int i = 0; i < stats_.substeps; ++i) {
+            for (size_t b = 0; b < bodies_.size(); ++b) {
+                vx_[b] += bodies_[b].gravity.x * step;
+                vy_[b] += bodies_[b].gravity.y * step;
             }
-            // Entity signature does not match system signature - erase from set
-            else {
-                system->entities_.erase(entity);
+            if (contacts) {
+                // The solver's impulses are per sub-step, so each sub-step starts from the last one's
+                solver_.warm_start(vx_.data(), vy_.data());
+                solver_.solve(vx_.data(), vy_.data(), WorkerPool::global());
+            }
+            for (size_t b = 0; b < bodies_.size(); ++b) {
+                raylib::Vector2 velocity{vx_[b], vy_[b]};
+                move(*bodies_[b].transform, velocity, velocity * step);
+                vx_[b] = velocity.x;
+                vy_[b] = velocity.y;
             }
         }
+
+        if (contacts)
+            solver_.finish();
+        for (size_t b = 0; b < bodies_.size(); ++b)
+            bodies_[b].body->velocity = {vx_[b], vy_[b]};
     }
 
   private:
-    // Map from system type string pointer to a signature
-    std::unordered_map<const char *, Signature> signatures_{};
+    struct Body {
+        Entity entity;
+        Transform *transform;
+        RigidBody *body;
+        raylib::Vector2 gravity;
+        bool fluid;
+    };
 
-    // Map from system type string pointer to a system pointer
-    std::unordered_map<const char *, std::shared_ptr<System>> systems_{};
-};
+    Options options_;
+    Stats stats_;
+    std::shared_ptr<const FluidSystem> fluid_;
+    Bvh4 colliders_;
+    std::vector<Aabb> collider_boxes_;
+    std::vector<std::uint32_t> collider_ids_;
+
+    // This frame's bodies, with velocities split out for the solver
+    std::vector<Body> bodies_;
+    std::vector<float> vx_, vy_, inv_mass_;
+    std::vector<Aabb> body_boxes_;
+    std::vector<std::uint32_t> body_ids_;
+    Bvh4 body_tree_;
+    std::vector<ContactSolver::Contact> contacts_;
+    ContactSolver solver_;
+
+    void gather_bodies(Coordinator &world) {
+        bodies_.clear();
+        vx_.clear();
+        vy_.clear();
+        inv_mass_.clear();
+        world.match(signature_, {}, [&](Entity entity) {
+            auto &rigidBody = world.get_component<RigidBody>(entity);
+            auto &transform = world.get_component<Transform>(entity);
+            bodies_.push_back({entity, &transform, &rigidBody, world.read_component<Gravity>(entity).force,
+                               fluid_ && fluid_->contains(world, entity)});
+            vx_.push_back(rigidBody.velocity.x);
+            vy_.push_back(rigidBody.velocity.y);
+            inv_mass_.push_back(transform.scale > 0.0f ? 1.0f / (transform.scale * transform.scale) : 1.0f);
+        });
+    }
 
-class Coordinator {
-  public:
-    void init() {
-        // Create pointers to each manager
-        component_manager_ = std::make_unique<ComponentManager>();
-        entity_manager_ = std::make_unique<EntityManager>();
-        system_manager_ = std::make_unique<SystemManager>();
+    // Overlapping body pairs, separated along the axis of least overlap.
+    // Returns whether there are any.
+    bool find_contacts() {
+        contacts_.clear();
+        body_boxes_.resize(bodies_.size());
+        body_ids_.resize(bodies_.size());
+        for (size_t b = 0; b < bodies_.size(); ++b) {
+            body_boxes_[b] = transform_bounds(*bodies_[b].transform);
+            body_ids_[b] = static_cast<std::uint32_t>(b);
+        }
+        body_tree_.build(body_boxes_.data(), body_ids_.data(), body_boxes_.size());
+
+        for (std::uint32_t a = 0; a < bodies_.size(); ++a) {
+            const Aabb &box = body_boxes_[a];
+            body_tree_.query_rect(box, [&](std::uint32_t b) {
+                if (b <= a || (bodies_[a].fluid && bodies_[b].fluid))
+                    return;
+                const Aabb &other = body_boxes_[b];
+                const float overlap_x = std::min(box.max_x, other.max_x) - std::max(box.min_x, other.min_x);
+                const float overlap_y = std::min(box.max_y, other.max_y) - std::max(box.min_y, other.min_y);
+                const bool along_x = overlap_x < overlap_y;
+                const float from = along_x ? box.min_x + box.max_x : box.min_y + box.max_y;
+                const float to = along_x ? other.min_x + other.max_x : other.min_y + other.max_y;
+                const float sign = to >= from ? 1.0f : -1.0f;
+                // Bodies are in entity order, so a's entity is the smaller one
+                const std::uint64_t key = std::uint64_t{bodies_[a].entity} << 32 | bodies_[b].entity;
+                contacts_.push_back({a, b, along_x ? sign : 0.0f, along_x ? 0.0f : sign,
+                                     along_x ? overlap_x : overlap_y, key});
+            });
+        }
+        return !contacts_.empty();
     }
 
-    // Entity methods
-    Entity create_entity() { return entity_manager_->create_entity(); }
+    void gather_colliders(Coordinator &world) {
+        collider_boxes_.clear();
+        collider_ids_.clear();
+        world.view<const Transform, const StaticCollider>().each(
+            [&](Entity, const Transform &transform, const StaticCollider &collider) {
+                collider_boxes_.push_back({transform.position.x, transform.position.y - collider.size.y,
+                                           transform.position.x + collider.size.x, transform.position.y});
+                collider_ids_.push_back(static_cast<std::uint32_t>(collider_boxes_.size() - 1));
+            });
+        colliders_.build(collider_boxes_.data(), collider_ids_.data(), collider_boxes_.size());
+    }
 
-    void destroy_entity(Entity entity) {
-        entity_manager_->destroy_entity(entity);
+    void move(Transform &transform, raylib::Vector2 &velocity, raylib::Vector2 displacement) {
+        if (collider_boxes_.empty()) {
+            transform.position += displacement;
+            return;
+        }
+        if (std::max(std::abs(displacement.x), std::abs(displacement.y)) > transform.scale) {
+            sweep(transform, velocity, displacement);
+            return;
+        }
 
-        component_manager_->entity_destroyed(entity);
+        // Push out of whatever the body ended up in. A body that was clear of
+        // the collider on only one axis before this move entered along it and
+        // goes back out that way; otherwise it takes the axis needing the
+        // smaller push. Entering bodies are pushed back the way they came (a
+        // thin collider may be closer to cross than to back out of), bodies
+        // that were already inside take the shortest way out.
+        const Aabb before = transform_bounds(transform);
+        transform.position += displacement;
+        const Aabb box = transform_bounds(transform);
+        colliders_.query_rect(box, [&](std::uint32_t id) {
+            const Aabb &solid = collider_boxes_[id];
+            const float left = box.max_x - solid.min_x, right = solid.max_x - box.min_x;
+            const float down = box.max_y - solid.min_y, up = solid.max_y - box.min_y;
+            if (left <= 0.0f || right <= 0.0f || down <= 0.0f || up <= 0.0f)
+                return; // Only touching
+            const bool clear_x = before.max_x <= solid.min_x || before.min_x >= solid.max_x;
+            const bool clear_y = before.max_y <= solid.min_y || before.min_y >= solid.max_y;
+            const float push_x = clear_x && displacement.x > 0.0f   ? -left
+                                 : clear_x && displacement.x < 0.0f ? right
+                                 : left < right                     ? -left
+                                                                    : right;
+            const float push_y = clear_y && displacement.y > 0.0f   ? -down
+                                 : clear_y && displacement.y < 0.0f ? up
+                                 : down < up                        ? -down
+                                                                    : up;
+            if (clear_x != clear_y ? clear_x : std::abs(push_x) < std::abs(push_y)) {
+                transform.position.x += push_x;
+                velocity.x = bounce(velocity.x, push_x);
+            } else {
+                transform.position.y += push_y;
+                velocity.y = bounce(velocity.y, push_y);
+            }
+            ++stats_.contacts;
+        });
+    }
 
-        system_manager_->entity_destroyed(entity);
+    // Move the body's box along `displacement`, stopping at the first
+    // collider it would enter and sliding along it for the rest of the step.
+    // A collider the box already touches, give or take SKIN of rounding,
+    // blocks motion into it at once.
+    void sweep(Transform &transform, raylib::Vector2 &velocity, raylib::Vector2 displacement) {
+        constexpr float SKIN = 1e-3f;
+        ++stats_.swept;
+        for (int pass = 0; pass < 2 && (displacement.x != 0.0f || displacement.y != 0.0f); ++pass) {
+            const Aabb from = transform_bounds(transform);
+            const Aabb to{from.min_x + displacement.x, from.min_y + displacement.y, from.max_x + displacement.x,
+                          from.max_y + displacement.y};
+            const float at[2] = {from.min_x, from.min_y};
+            const float d[2] = {displacement.x, displacement.y};
+
+            float first = 1.0f;
+            int axis = -1;
+            colliders_.query_rect(from.merged(to), [&](std::uint32_t id) {
+                const Aabb &solid = collider_boxes_[id];
+                // When the box's min corner enters the collider grown by the box's size
+                const float lo[2] = {solid.min_x - (from.max_x - from.min_x), solid.min_y - (from.max_y - from.min_y)};
+                const float hi[2] = {solid.max_x, solid.max_y};
+                float enter = -std::numeric_limits<float>::infinity();
+                float exit = std::numeric_limits<float>::infinity();
+                int enter_axis = -1;
+                for (int k = 0; k < 2; ++k) {
+                    if (d[k] == 0.0f) {
+                        if (at[k] <= lo[k] || at[k] >= hi[k])
+                            return;
+                        continue;
+                    }
+                    float t0 = (lo[k] - at[k]) / d[k];
+                    float t1 = (hi[k] - at[k]) / d[k];
+                    if (t0 > t1)
+                        std::swap(t0, t1);
+                    if (t0 > enter) {
+                        enter = t0;
+                        enter_axis = k;
+                    }
+                    exit = std::min(exit, t1);
+                }
+                if (enter_axis < 0 || enter >= exit || exit <= 0.0f)
+                    return;
+                if (enter < 0.0f && -enter * std::abs(d[enter_axis]) > SKIN)
+                    return; // Properly inside, the overlap check deals with it
+                enter = std::max(enter, 0.0f);
+                if (enter < first) {
+                    first = enter;
+                    axis = enter_axis;
+                }
+            });
+
+            transform.position += displacement * first;
+            if (axis < 0)
+                break;
+            ++stats_.contacts;
+            displacement = displacement * (1.0f - first);
+            if (axis == 0) {
+                velocity.x = bounce(velocity.x, -d[0]);
+                displacement.x = 0.0f;
+            } else {
+                velocity.y = bounce(velocity.y, -d[1]);
+                displacement.y = 0.0f;
+            }
+        }
     }
 
-    // Component methods
-    template <typename T>
-    void register_component() {
-        component_manager_->register_component<T>();
+    // Velocity along an axis after a push in direction `normal`; only velocity
+    // heading into the collider is reflected
+    float bounce(float v, float normal) const {
+        return (normal > 0.0f) == (v < 0.0f) ? -v * options_.restitution : v;
     }
+};
 
-    template <typename T>
-    void add_component(Entity entity, T component) {
-        component_manager_->add_component<T>(entity, component);
+// Entities that haven't moved for SETTLE_FRAMES frames are drawn once into
+// an offscreen layer that is composited each frame, and only the rest are
+// drawn on top of it. When a cached entity moves, changes renderable, or
+// leaves the system, the area it covered is marked dirty and just that part
+// of the layer is cleared and redrawn. Cached entities therefore draw below
+// moving ones regardless of entity order.
+class RenderSystem : public System {
+  public:
+    static constexpr std::uint16_t SETTLE_FRAMES = 30;
+    static constexpr size_t MAX_DIRTY = 64; // More dirty regions than this redraw the whole layer
 
-        auto signature = entity_manager_->get_signature(entity);
-        signature.set(component_manager_->get_component_type<T>(), true);
-        entity_manager_->set_signature(entity, signature);
+    bool cache_static = true;
 
-        system_manager_->entity_signature_changed(entity, signature);
+    ~RenderSystem() {
+        if (layer_.id)
+            UnloadRenderTexture(layer_);
     }
 
-    template <typename T>
-    void remove_component(Entity entity) {
-        component_manager_->remove_component<T>(entity);
-
-        auto signature = entity_manager_->get_signature(entity);
-        signature.set(component_manager_->get_component_type<T>(), false);
-        entity_manager_->set_signature(entity, signature);
+    void init(){};
+    void update(float dt) { update(gCoordinator, dt); }
+    void update(Coordinator &world, float dt) {
+        if (!cache_static) {
+            world.match(signature_, {}, [&](Entity entity) {
+                auto const &transform = world.read_component<Transform>(entity);
+                auto const &renderable = world.read_component<std::shared_ptr<Renderable>>(entity);
+                renderable->Draw(transform);
+            });
+            return;
+        }
 
-        system_manager_->entity_signature_changed(entity, signature);
-    }
+        ++frame_;
+        moving_.clear();
+        world.match(signature_, {}, [&](Entity entity) {
+            auto const &transform = world.read_component<Transform>(entity);
+            auto const &renderable = world.read_component<std::shared_ptr<Renderable>>(entity);
+            if (entity >= slots_.size())
+                slots_.resize(entity + 1);
+            auto &slot = slots_[entity];
+            // Not drawn last frame, so the id may since have been reused
+            if (slot.seen + 1 != frame_)
+                slot.renderable = nullptr;
+            slot.seen = frame_;
+
+            const bool still = slot.renderable == renderable.get() && slot.transform.position.x == transform.position.x &&
+                               slot.transform.position.y == transform.position.y &&
+                               slot.transform.rotation == transform.rotation && slot.transform.scale == transform.scale;
+            if (!still) {
+                if (slot.cached)
+                    uncache(slot);
+                slot.transform = transform;
+                slot.renderable = renderable.get();
+                slot.still_frames = 0;
+            } else if (!slot.cached && ++slot.still_frames >= SETTLE_FRAMES) {
+                slot.cached = true;
+                slot.bounds = renderable->Bounds(transform);
+                slot.cached_at = cached_.size();
+                cached_.push_back(entity);
+                mark_dirty(slot.bounds);
+            }
+            if (!slot.cached)
+                moving_.push_back({entity, renderable.get()});
+        });
+
+        // Cached entities that were destroyed, disabled or lost a component
+        for (size_t i = 0; i < cached_.size();) {
+            auto &slot = slots_[cached_[i]];
+            if (slot.seen != frame_) {
+                uncache(slot);
+                slot.renderable = nullptr;
+            } else {
+                ++i;
+            }
+        }
 
-    template <typename T>
-    T &get_component(Entity entity) {
-        return component_manager_->get_component<T>(entity);
-    }
+        redraw_layer(world);
+        if (!cached_.empty())
+            DrawTextureRec(layer_.texture, {0.0f, 0.0f, (float)layer_.texture.width, -(float)layer_.texture.height},
+                           {0.0f, 0.0f}, WHITE);
 
-    template <typename T>
-    ComponentType get_component_type() {
-        return component_manager_->get_component_type<T>();
-    }
+        for (auto const &[entity, renderable] : moving_)
+            renderable->Draw(world.read_component<Transform>(entity));
+    };
 
-    // System methods
-    template <typename T>
-    std::shared_ptr<T> register_system() {
-        return system_manager_->register_system<T>();
-    }
+    // Redraw the whole layer on the next update, e.g. after changing what a
+    // cached entity's renderable looks like
+    void invalidate() { full_redraw_ = true; }
 
-    template <typename T>
-    void set_system_signature(Signature signature) {
-        system_manager_->set_signature<T>(signature);
-    }
+    size_t cached_count() const { return cached_.size(); }
 
   private:
-    std::unique_ptr<ComponentManager> component_manager_;
-    std::unique_ptr<EntityManager> entity_manager_;
-    std::unique_ptr<SystemManager> system_manager_;
-};
+    struct Slot {
+        Transform transform;
+        const Renderable *renderable = nullptr;
+        ::Rectangle bounds{};
+        size_t cached_at = 0; // Position in cached_
+        std::uint64_t seen = 0;
+        std::uint16_t still_frames = 0;
+        bool cached = false;
+    };
 
-Coordinator gCoordinator;
+    std::vector<Slot> slots_;      // By entity
+    std::vector<Entity> cached_;   // Entities drawn in the layer
+    std::vector<std::pair<Entity, Renderable *>> moving_;
+    std::vector<::Rectangle> dirty_;
+    bool full_redraw_ = true;
+    std::uint64_t frame_ = 0;
+    RenderTexture2D layer_{};
+
+    void uncache(Slot &slot) {
+        mark_dirty(slot.bounds);
+        slot.cached = false;
+        slot.still_frames = 0;
+        cached_[slot.cached_at] = cached_.back();
+        slots_[cached_.back()].cached_at = slot.cached_at;
+        cached_.pop_back();
+    }
 
-class PhysicsSystem : public System {
-  public:
-    void init(){};
-    void update(float dt) {
-        for (auto const &entity : entities_) {
-            auto &rigidBody = gCoordinator.get_component<RigidBody>(entity);
-            auto &transform = gCoordinator.get_component<Transform>(entity);
-            auto const &gravity = gCoordinator.get_component<Gravity>(entity);
+    void mark_dirty(const ::Rectangle &bounds) {
+        if (dirty_.size() == MAX_DIRTY)
+            full_redraw_ = true;
+        else
+            dirty_.push_back(bounds);
+    }
 
-            transform.position += rigidBody.velocity * dt;
+    static bool overlaps(const ::Rectangle &a, const ::Rectangle &b) {
+        return a.x < b.x + b.width && b.x < a.x + a.width && a.y < b.y + b.height && b.y < a.y + a.height;
+    }
 
-            rigidBody.velocity += gravity.force * dt;
+    void redraw_layer(Coordinator &world) {
+        const int width = window.GetWidth();
+        const int height = window.GetHeight();
+        if (!layer_.id || layer_.texture.width != width || layer_.texture.height != height) {
+            if (layer_.id)
+                UnloadRenderTexture(layer_);
+            layer_ = LoadRenderTexture(width, height);
+            full_redraw_ = true;
         }
-    };
-};
-
-class RenderSystem : public System {
-  public:
-    void init(){};
-    void update(float dt) {
-        for (auto const &entity : entities_) {
-            auto &transform = gCoordinator.get_component<Transform>(entity);
-            auto &renderable = gCoordinator.get_component<std::shared_ptr<Renderable>>(entity);
-            renderable->Draw(transform);
+        if (!full_redraw_ && dirty_.empty())
+            return;
+
+        auto draw_cached = [&](const ::Rectangle *region) {
+            for (Entity entity : cached_)
+                if (!region || overlaps(slots_[entity].bounds, *region))
+                    world.read_component<std::shared_ptr<Renderable>>(entity)->Draw(slots_[entity].transform);
+        };
+
+        BeginTextureMode(layer_);
+        if (full_redraw_) {
+            ClearBackground(BLANK);
+            draw_cached(nullptr);
+        } else {
+            for (auto const &bounds : dirty_) {
+                // Whole pixels, one pixel of slack for edge rasterization
+                const int x0 = std::max(0, (int)std::floor(bounds.x) - 1);
+                const int y0 = std::max(0, (int)std::floor(bounds.y) - 1);
+                const int x1 = std::min(width, (int)std::ceil(bounds.x + bounds.width) + 1);
+                const int y1 = std::min(height, (int)std::ceil(bounds.y + bounds.height) + 1);
+                if (x0 >= x1 || y0 >= y1)
+                    continue;
+                const ::Rectangle region{(float)x0, (float)y0, (float)(x1 - x0), (float)(y1 - y0)};
+                BeginScissorMode(x0, y0, x1 - x0, y1 - y0);
+                ClearBackground(BLANK);
+                draw_cached(&region);
+                EndScissorMode();
+            }
         }
-    };
+        EndTextureMode();
+        dirty_.clear();
+        full_redraw_ = false;
+    }
 };
 
+// Spawn `count` entities in waves of `per_wave`, `interval` seconds apart,
+// spawn(n) creating n of them
+template <typename F>
+Behavior spawn_sequence(size_t count, size_t per_wave, double interval, F spawn) {
+    for (size_t spawned = 0; spawned < count;) {
+        const size_t wave = std::min(per_wave, count - spawned);
+        spawn(wave);
+        spawned += wave;
+        co_await seconds(interval);
+    }
+}
+
 } // namespace pixelz
 
+// Build with -DPIXELZ_FLUID_PARTICLES=1 to pour the particles in as a fluid
+#ifndef PIXELZ_FLUID_PARTICLES
+#define PIXELZ_FLUID_PARTICLES 0
+#endif
+
+// Build with -DPIXELZ_MUTUAL_GRAVITY=1 to have the particles attract each other
+#ifndef PIXELZ_MUTUAL_GRAVITY
+#define PIXELZ_MUTUAL_GRAVITY 0
+#endif
+
 int main() {
     SetTargetFPS(60);
 
@@ -426,6 +3366,29 @@ int main() {
     gCoordinator.register_component<RigidBody>();
     gCoordinator.register_component<pixelz::Transform>();
     gCoordinator.register_component<std::shared_ptr<pixelz::Renderable>>();
+    gCoordinator.register_component<StaticCollider>();
+    gCoordinator.register_component<Fluid>();
+    gCoordinator.register_component<Mass>();
+
+    auto fluid_system = gCoordinator.register_system<FluidSystem>();
+    {
+        Signature signature;
+        signature.set(gCoordinator.get_component_type<RigidBody>());
+        signature.set(gCoordinator.get_component_type<pixelz::Transform>());
+        signature.set(gCoordinator.get_component_type<Fluid>());
+        gCoordinator.set_system_signature<FluidSystem>(signature);
+    }
+    fluid_system->init();
+
+    auto gravitation_system = gCoordinator.register_system<GravitationSystem>();
+    {
+        Signature signature;
+        signature.set(gCoordinator.get_component_type<RigidBody>());
+        signature.set(gCoordinator.get_component_type<pixelz::Transform>());
+        signature.set(gCoordinator.get_component_type<Mass>());
+        gCoordinator.set_system_signature<GravitationSystem>(signature);
+    }
+    gravitation_system->init();
 
     auto physics_system = gCoordinator.register_system<PhysicsSystem>();
     {
@@ -436,6 +3399,7 @@ int main() {
         gCoordinator.set_system_signature<PhysicsSystem>(signature);
     }
     physics_system->init();
+    physics_system->set_fluid(fluid_system);
 
     auto render_system = gCoordinator.register_system<RenderSystem>();
     {
@@ -446,43 +3410,131 @@ int main() {
     }
     render_system->init();
 
-    std::vector<Entity> entities(MAX_ENTITIES);
-
-    std::default_random_engine generator;
-    std::uniform_real_distribution<float> randX(0.0f, window.GetWidth());
-    std::uniform_real_distribution<float> randY(100.0f, window.GetHeight() + 100.0f);
-    std::uniform_real_distribution<float> randRotation(0.0f, 3.1415926f);
-    std::uniform_real_distribution<float> randScale(4.0f, 20.0f);
-    std::uniform_real_distribution<float> randGravity(-10.0f, -1.0f);
-    std::uniform_int_distribution<uint8_t> randColor(0, 255);
-
-    for (auto &entity : entities) {
-        float scale = randScale(generator);
-
-        entity = gCoordinator.create_entity();
+    // A thin floor along the bottom of the window for the particles to land on
+    {
+        Entity floor = gCoordinator.create_entity();
+        gCoordinator.add_components(floor, pixelz::Transform{.position = {0.0f, 0.0f}},
+                                    StaticCollider{.size = {(float)window.GetWidth(), 1.0f}});
+    }
 
-        gCoordinator.add_component(entity, Gravity{.force = {0.0f, randGravity(generator)}});
-        gCoordinator.add_component(entity, RigidBody{.velocity = {0.0f, 0.0f}, .acceleration = {0.0f, 0.0f}});
-        gCoordinator.add_component(entity, pixelz::Transform{.position = {randX(generator), randY(generator)},
-                                                             .rotation = randRotation(generator),
-                                                             .scale = scale});
+    // Each particle draws from its own (seed, entity) stream, so a wave's
+    // numbers are generated in parallel, four streams per SIMD pass, and come
+    // out the same however the work is split
+    constexpr std::uint64_t SPAWN_SEED = 1;
+    constexpr std::uint32_t SPAWN_STREAM = 0;
+    constexpr size_t SPAWN_BLOCKS = 2; // 8 numbers per particle
+
+    struct Particle {
+        Gravity gravity;
+        pixelz::Transform transform;
+        raylib::Color color;
+    };
+    std::vector<Entity> wave;
+    std::vector<Particle> particles;
+    std::vector<Philox::Counter> numbers;
+
+    auto spawn_particles = [&](size_t count) {
+        wave.resize(count);
+        particles.resize(count);
+        numbers.resize(count * SPAWN_BLOCKS);
+        for (auto &entity : wave)
+            entity = gCoordinator.create_entity();
+
+        const float width = window.GetWidth(), height = window.GetHeight();
+        WorkerPool::global().parallel_for(count, 256, [&](size_t begin, size_t end) {
+            stream_blocks(SPAWN_SEED, SPAWN_STREAM, &wave[begin], end - begin, SPAWN_BLOCKS,
+                          &numbers[begin * SPAWN_BLOCKS]);
+            for (size_t i = begin; i < end; ++i) {
+                const Philox::Counter &a = numbers[i * SPAWN_BLOCKS], &b = numbers[i * SPAWN_BLOCKS + 1];
+                const float scale = 4.0f + 16.0f * unit_float(a[0]);
+                particles[i] = {
+                    Gravity{.force = {0.0f, -10.0f + 9.0f * unit_float(a[1])}},
+                    pixelz::Transform{.position = {width * unit_float(a[2]), 100.0f + height * unit_float(a[3])},
+                                      .rotation = 3.1415926f * unit_float(b[0]),
+                                      .scale = scale},
+                    raylib::Color(b[1] & 0xFF, b[1] >> 8 & 0xFF, b[1] >> 16 & 0xFF, 255),
+                };
+            }
+        });
+
+        for (size_t i = 0; i < count; ++i) {
+            Entity entity = wave[i];
+            const Particle &particle = particles[i];
+            std::shared_ptr<Renderable> ptr = std::make_shared<pixelz::Rectangle>(particle.color);
+            // One add_components call per particle whichever optional components the build adds
+            auto add = [&](auto... extra) {
+                gCoordinator.add_components(entity, particle.gravity,
+                                            RigidBody{.velocity = {0.0f, 0.0f}, .acceleration = {0.0f, 0.0f}},
+                                            particle.transform, ptr, extra...);
+            };
+            const Mass mass{.value = particle.transform.scale * particle.transform.scale};
+            if constexpr (PIXELZ_FLUID_PARTICLES && PIXELZ_MUTUAL_GRAVITY)
+                add(Fluid{}, mass);
+            else if constexpr (PIXELZ_FLUID_PARTICLES)
+                add(Fluid{});
+            else if constexpr (PIXELZ_MUTUAL_GRAVITY)
+                add(mass);
+            else
+                add();
+        }
+    };
 
-        std::shared_ptr<Renderable> ptr = std::make_shared<pixelz::Rectangle>(
-            raylib::Color(randColor(generator), randColor(generator), randColor(generator), 255));
+    // Pour the particles in over a couple of seconds rather than all at once,
+    // filling every entity slot the floor left
+    BehaviorScheduler behaviors;
+    behaviors.spawn(spawn_sequence(MAX_ENTITIES - 1, MAX_ENTITIES / 10, 0.2, spawn_particles));
 
-        gCoordinator.add_component(entity, ptr);
-    }
+    // F9 starts and stops recording to pixelz-capture.y4m. A stopped writer
+    // finishes the frames it has queued on its own thread and is dropped
+    // once done; a new recording waits for that, as it reuses the file.
+    bool capturing = false;
+    std::unique_ptr<FrameWriter> capture, closing;
+    std::vector<std::uint8_t> screen; // Readback buffer, reallocated only when the window size changes
 
     float dt = 0.0f;
     while (!window.ShouldClose()) {
         auto st = window.GetTime();
 
+        if (closing && closing->done())
+            closing.reset();
+        if (IsKeyPressed(KEY_F9)) {
+            capturing = !capturing;
+            if (capture) {
+                capture->finish();
+                closing = std::move(capture);
+            }
+        }
+
+        behaviors.tick(dt);
+        fluid_system->update(dt);
+        gravitation_system->update(dt);
         physics_system->update(dt);
 
         window.BeginDrawing();
         {
             window.ClearBackground(BLACK);
             render_system->update(dt);
+
+            const Vector2 dpi = GetWindowScaleDPI();
+            const int width = GetScreenWidth() * dpi.x, height = GetScreenHeight() * dpi.y;
+            if (capturing && !closing && width > 0 && height > 0) {
+                // The readback itself is synchronous, everything after the copy into the ring is not.
+                // Flush raylib's batch first, or the last batch of sprites is missing from the frame.
+                rlDrawRenderBatchActive();
+                screen.resize(size_t(width) * height * 4);
+                glReadPixels(0, 0, width, height, PIXELZ_GL_RGBA, PIXELZ_GL_UNSIGNED_BYTE, screen.data());
+                if (!capture)
+                    capture = std::make_unique<FrameWriter>("pixelz-capture.y4m", width, height, 60);
+                // GL hands rows back bottom-up
+                const std::ptrdiff_t row = std::ptrdiff_t(width) * 4;
+                capture->submit(screen.data() + (height - 1) * row, width, height, -row);
+
+                // Drawn after the readback so it stays out of the recording
+                auto stats = capture->stats();
+                std::string status = "REC " + std::to_string(stats.written) + " frames, " +
+                                     std::to_string(stats.dropped) + " dropped";
+                DrawText(status.c_str(), 10, 10, 20, capture->ok() ? RED : GRAY);
+            }
         }
         window.EndDrawing();
 